@@ -0,0 +1,186 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include "board.h"
+#include "move_gen.h"
+#include "eval.h"
+#include "search.h"
+#include "zobrist.h"
+#include "attacks.h"
+#include "bench.h"
+
+// Micro-benchmarks for the engine's hot functions, run over the bench position corpus
+// Reports ns/op per function; "--json FILE" also writes the results in Google Benchmark's JSON layout,
+// so existing tooling such as compare.py can diff two runs
+// Usage: bench_micro [--json FILE] [--filter SUBSTRING] [--min-time SECONDS]
+
+struct MicroResult {
+    std::string name;
+    uint64_t iterations; // operations timed
+    double ns_per_op;
+};
+
+// Results are folded into this so the compiler cannot drop the benchmarked calls
+static volatile uint64_t sink;
+
+// Repeats a pass over the corpus until min_time seconds have elapsed; pass() returns the number of operations it did
+template <typename Pass>
+static MicroResult run_micro(const std::string& name, double min_time, Pass pass){
+    using clock = std::chrono::steady_clock;
+    pass(); // warm up caches and branch predictors
+    uint64_t ops = 0;
+    auto start = clock::now();
+    double elapsed = 0;
+    do{
+        ops += pass();
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    } while(elapsed < min_time);
+    return {name, ops, elapsed * 1e9 / double(ops)};
+}
+
+static void write_json(const std::string& path, const std::vector<MicroResult>& results){
+    std::ofstream out(path);
+    out << "{\n  \"context\": {\"executable\": \"bench_micro\", \"positions\": " << BENCH_FENS.size() << "},\n";
+    out << "  \"benchmarks\": [\n";
+    for(size_t i = 0; i < results.size(); i++){
+        const MicroResult& r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"run_type\": \"iteration\", \"iterations\": " << r.iterations
+            << ", \"real_time\": " << r.ns_per_op << ", \"cpu_time\": " << r.ns_per_op << ", \"time_unit\": \"ns\"}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char* argv[]){
+    Zobrist::init();
+    init_attacks();
+    init_pst();
+
+    std::string json_path, filter;
+    double min_time = 0.5;
+    for(int i = 1; i + 1 < argc; i++){
+        if(std::strcmp(argv[i], "--json") == 0) json_path = argv[++i];
+        else if(std::strcmp(argv[i], "--filter") == 0) filter = argv[++i];
+        else if(std::strcmp(argv[i], "--min-time") == 0) min_time = std::stod(argv[++i]);
+    }
+
+    // corpus boards; get_board returns a board whose st points at its own root, so repoint it after the copy
+    std::vector<Board> boards;
+    boards.reserve(BENCH_FENS.size());
+    for(const std::string& fen : BENCH_FENS){
+        boards.push_back(get_board(fen));
+        boards.back().st = &boards.back().root;
+    }
+    std::vector<MoveList> legal(boards.size());
+    for(size_t i = 0; i < boards.size(); i++) generate_moves(boards[i], legal[i]);
+
+    StateStack ss;
+    TranspositionTable tt;
+    tt.resize_mb(16);
+    const int TT_KEYS = 1 << 16;
+    std::vector<uint64_t> keys(TT_KEYS);
+    SplitMix64 rng(0xBE7C4);
+    for(uint64_t& k : keys) k = rng.next();
+
+    std::vector<MicroResult> results;
+    auto bench = [&](const std::string& name, auto pass){
+        if(!filter.empty() && name.find(filter) == std::string::npos) return;
+        results.push_back(run_micro(name, min_time, pass));
+        const MicroResult& r = results.back();
+        std::printf("%-24s %14llu ops %10.1f ns/op\n", r.name.c_str(), (unsigned long long)r.iterations, r.ns_per_op);
+        std::fflush(stdout);
+    };
+
+    bench("generate_pseudo", [&]{
+        uint64_t n = 0;
+        for(Board& b : boards){ MoveList list; generate_pseudo(b, b.to_move, list); n += list.size(); }
+        sink += n;
+        return uint64_t(boards.size());
+    });
+    bench("generate_moves", [&]{
+        uint64_t n = 0;
+        for(Board& b : boards){ MoveList list; generate_moves(b, list); n += list.size(); }
+        sink += n;
+        return uint64_t(boards.size());
+    });
+    bench("generate_captures", [&]{
+        uint64_t n = 0;
+        for(Board& b : boards){ MoveList list; generate_captures(b, list); n += list.size(); }
+        sink += n;
+        return uint64_t(boards.size());
+    });
+    bench("do_move+undo_move", [&]{
+        uint64_t ops = 0;
+        for(size_t i = 0; i < boards.size(); i++){
+            Board& b = boards[i];
+            StGuard guard(b, init_state_stack(b, ss));
+            for(Move m : legal[i]){
+                do_move(b, ss, m);
+                sink += b.st->zobrist;
+                undo_move(b, ss, m);
+            }
+            ops += legal[i].size();
+        }
+        return ops;
+    });
+    bench("see", [&]{
+        uint64_t ops = 0;
+        for(size_t i = 0; i < boards.size(); i++)
+            for(Move m : legal[i])
+                if(is_capture(boards[i], m)){ sink += see(boards[i], m, 0); ops++; }
+        return ops;
+    });
+    bench("square_attacked", [&]{
+        uint64_t n = 0;
+        for(Board& b : boards)
+            for(int sq = A1; sq <= H8; sq++) n += square_attacked(b, sq, !b.to_move);
+        sink += n;
+        return uint64_t(boards.size()) * 64;
+    });
+    bench("evaluate", [&]{
+        int64_t n = 0;
+        for(Board& b : boards) n += evaluate(b);
+        sink += uint64_t(n);
+        return uint64_t(boards.size());
+    });
+    bench("evaluate_ref", [&]{
+        int64_t n = 0;
+        for(Board& b : boards) n += evaluate_ref(b);
+        sink += uint64_t(n);
+        return uint64_t(boards.size());
+    });
+    bench("compute_zobrist", [&]{
+        uint64_t n = 0;
+        for(Board& b : boards) n ^= compute_zobrist(b);
+        sink += n;
+        return uint64_t(boards.size());
+    });
+    bench("tt_store", [&]{
+        for(int i = 0; i < TT_KEYS; i++) tt.store(keys[i], i & 31, i, TT_EXACT, Move(i));
+        return uint64_t(TT_KEYS);
+    });
+    // fill the table here rather than relying on tt_store, so "--filter tt_probe" alone sees the same hit rate
+    tt.clear();
+    for(int i = 0; i < TT_KEYS; i++) tt.store(keys[i], i & 31, i, TT_EXACT, Move(i));
+    bench("tt_probe", [&]{
+        uint64_t n = 0;
+        for(int i = 0; i < TT_KEYS; i++){
+            int alpha = -32000, beta = 32000, score = 0;
+            Move move = 0;
+            // odd probes use keys that were never stored, so about half of them miss
+            n += tt.probe(keys[i] ^ (i & 1), 0, 0, alpha, beta, score, move);
+        }
+        sink += n;
+        return uint64_t(TT_KEYS);
+    });
+
+    if(!json_path.empty()){
+        write_json(json_path, results);
+        std::cout << "wrote " << json_path << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include <cstdlib>
+#include <cstdint>
+#include "alloc.h"
+
+#if defined(_WIN32)
+#include <malloc.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+#if defined(__linux__) && defined(USE_NUMA)
+// Interleave the pages of a region across all NUMA nodes; must be done before the pages are first touched
+// Calls mbind directly so that libnuma is not needed; nodes that do not exist are ignored by the kernel
+// https://man7.org/linux/man-pages/man2/mbind.2.html
+static void numa_interleave(void* mem, size_t size){
+    constexpr int MPOL_INTERLEAVE_MODE = 3;
+    unsigned long nodemask = ~0UL;
+    syscall(SYS_mbind, mem, size, MPOL_INTERLEAVE_MODE, &nodemask, sizeof(nodemask) * 8, 0);
+}
+#endif
+
+// Allocates at least bytes of memory aligned to 2MB, backed by huge pages and NUMA-interleaved where available
+void* large_alloc(size_t bytes){
+    size_t size = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+#if defined(_WIN32)
+    return _aligned_malloc(size, HUGE_PAGE_SIZE);
+#else
+    void* mem = nullptr;
+    if(posix_memalign(&mem, HUGE_PAGE_SIZE, size) != 0) return nullptr;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    madvise(mem, size, MADV_HUGEPAGE);
+#endif
+#if defined(__linux__) && defined(USE_NUMA)
+    numa_interleave(mem, size);
+#endif
+    return mem;
+#endif
+}
+
+// Frees memory obtained from large_alloc
+void large_free(void* mem){
+#if defined(_WIN32)
+    _aligned_free(mem);
+#else
+    free(mem);
+#endif
+}
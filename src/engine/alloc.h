@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+
+// Allocates at least bytes of memory for large tables (e.g. the transposition table), aligned to 2MB
+// On Linux the region is advised to use transparent huge pages, which cuts TLB misses on random probes;
+// when built with NUMA=1 it is also interleaved across all NUMA nodes so that no single node's memory bandwidth becomes the bottleneck
+// The memory is not initialized; returns nullptr on failure
+void* large_alloc(size_t bytes);
+
+// Frees memory obtained from large_alloc
+void large_free(void* mem);
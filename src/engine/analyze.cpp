@@ -0,0 +1,220 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "analyze.h"
+#include "board.h"
+#include "move_gen.h"
+#include "search.h"
+#include "time_man.h"
+#include "uci.h"
+
+// Checks the piece placement field of a FEN: eight ranks of eight squares and exactly one king per side
+static bool valid_placement(const std::string& pieces){
+    int ranks = 1, squares = 0, white_kings = 0, black_kings = 0;
+    for(char c : pieces){
+        if(c == '/'){
+            if(squares != 8) return false;
+            ranks++;
+            squares = 0;
+        }
+        else if(c >= '1' && c <= '8') squares += c - '0';
+        else if(std::string("pnbrqkPNBRQK").find(c) != std::string::npos){
+            squares++;
+            white_kings += c == 'K';
+            black_kings += c == 'k';
+        }
+        else return false;
+        if(squares > 8) return false;
+    }
+    return ranks == 8 && squares == 8 && white_kings == 1 && black_kings == 1;
+}
+
+static bool is_number(const std::string& s){
+    return !s.empty() && std::all_of(s.begin(), s.end(), [](char c){ return c >= '0' && c <= '9'; });
+}
+
+// Turns one line of the input into a six-field FEN that get_board() accepts
+// Takes both FENs and EPDs: an EPD has only the first four fields, followed by opcodes such as bm, am and id
+// A missing move clock becomes "0 1"; the EPD id opcode, if any, is returned in id
+static bool parse_position(const std::string& line, std::string& fen, std::string& id){
+    std::istringstream ss(line);
+    std::vector<std::string> f;
+    std::string token;
+    while(f.size() < 6 && ss >> token) f.push_back(token);
+    if(f.size() < 4 || !valid_placement(f[0]) || (f[1] != "w" && f[1] != "b")) return false;
+    if(f[2] != "-" && f[2].find_first_not_of("KQkq") != std::string::npos) return false;
+    if(f[3] != "-" && (f[3].size() != 2 || f[3][0] < 'a' || f[3][0] > 'h' || (f[3][1] != '3' && f[3][1] != '6'))) return false;
+
+    bool clocks = f.size() == 6 && is_number(f[4]) && is_number(f[5]);
+    fen = f[0] + " " + f[1] + " " + f[2] + " " + f[3] + (clocks ? " " + f[4] + " " + f[5] : " 0 1");
+
+    id.clear();
+    size_t pos = line.find("id \"");
+    if(pos != std::string::npos){
+        size_t end = line.find('"', pos + 4);
+        if(end != std::string::npos) id = line.substr(pos + 4, end - pos - 4);
+    }
+    return true;
+}
+
+static std::string json_escape(const std::string& s){
+    std::string out;
+    for(char c : s){
+        if(c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+// Same for a CSV field: quoted only when it holds a separator or a quote
+static std::string csv_escape(const std::string& s){
+    if(s.find_first_of(",\"") == std::string::npos) return s;
+    std::string out = "\"";
+    for(char c : s){
+        if(c == '"') out += '"';
+        out += c;
+    }
+    return out + "\"";
+}
+
+// Streams every position of the input file through a pool of single-threaded searches and writes one result line per position
+// Workers pull lines from the shared input one at a time, so a slow position only holds up its own worker
+// Each worker has its own Board, StateStack and a private slice of the hash: no TT entry is shared, so no locking is needed in the search
+long long run_analyze(const AnalyzeOptions& opts){
+    std::ifstream in(opts.input);
+    if(!in){
+        std::cerr << "Cannot open input file " << opts.input << "\n";
+        return -1;
+    }
+    std::ofstream file;
+    if(!opts.output.empty()){
+        file.open(opts.output);
+        if(!file){
+            std::cerr << "Cannot open output file " << opts.output << "\n";
+            return -1;
+        }
+    }
+    std::ostream& out = opts.output.empty() ? std::cout : file;
+    bool csv = opts.format == "csv";
+    if(csv) out << "line,id,fen,bestmove,score_cp,mate,depth,nodes,time_ms" << std::endl;
+
+    std::mutex in_mutex, out_mutex;
+    long long line_no = 0, analyzed = 0, skipped = 0;
+    uint64_t total_nodes = 0;
+    size_t worker_mb = std::max(1, opts.hash_mb / opts.threads);
+    auto start = std::chrono::steady_clock::now();
+
+    auto worker = [&](){
+        TranspositionTable tt;
+        tt.resize_mb(worker_mb);
+        std::string line, fen, id;
+        for(;;){
+            long long n;
+            {
+                std::lock_guard<std::mutex> lock(in_mutex);
+                if(!std::getline(in, line)) return;
+                n = ++line_no;
+            }
+            if(line.find_first_not_of(" \t\r") == std::string::npos || line[0] == '#') continue;
+            if(!parse_position(line, fen, id)){
+                std::lock_guard<std::mutex> lock(out_mutex);
+                std::cerr << "line " << n << ": not a valid FEN or EPD, skipped\n";
+                skipped++;
+                continue;
+            }
+
+            Board board = get_board(fen);
+            board.st = &board.root;
+
+            // a position without legal moves is not searched: it is reported at depth 0 with no best move,
+            // as "mate 0" when the side to move is checkmated and as a draw when it is stalemated
+            MoveList legal;
+            generate_moves(board, legal);
+            bool mated = legal.size() == 0 && square_attacked(board, king_square(board, board.to_move), !board.to_move);
+            SearchStats stats{};
+            SearchResult r{};
+            int ms = 0;
+            if(legal.size() > 0){
+                TimeManager tm;
+                if(opts.movetime_ms > 0) tm.init_movetime(opts.movetime_ms);
+                else tm.init_infinite(); // the depth limit alone ends the search
+                tm.start_clock();
+                r = iter_deepening(board, tt, stats, tm, opts.depth);
+                ms = tm.elapsed_ms();
+            }
+
+            std::string best = r.best_move ? move_to_uci(r.best_move) : "";
+            int mate = mate_in(r.score_cp);
+            bool has_mate = mated || mate != 0;
+            std::ostringstream rec;
+            if(csv){
+                rec << n << "," << csv_escape(id) << "," << fen << "," << best << ","
+                    << (has_mate ? "" : std::to_string(r.score_cp)) << "," << (has_mate ? std::to_string(mate) : "") << ","
+                    << stats.depth << "," << stats.nodes << "," << ms;
+            }
+            else{
+                rec << "{\"line\":" << n;
+                if(!id.empty()) rec << ",\"id\":\"" << json_escape(id) << "\"";
+                rec << ",\"fen\":\"" << fen << "\",\"bestmove\":" << (best.empty() ? "null" : "\"" + best + "\"") << ",";
+                if(has_mate) rec << "\"mate\":" << mate;
+                else rec << "\"score_cp\":" << r.score_cp;
+                rec << ",\"depth\":" << stats.depth << ",\"nodes\":" << stats.nodes << ",\"time_ms\":" << ms << "}";
+            }
+
+            std::lock_guard<std::mutex> lock(out_mutex);
+            out << rec.str() << std::endl;
+            analyzed++;
+            total_nodes += stats.nodes;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for(int i = 1; i < opts.threads; i++) pool.emplace_back(worker);
+    worker();
+    for(auto& t : pool) t.join();
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    uint64_t nps = (ms > 0) ? (total_nodes * 1000ULL) / ms : 0;
+    std::cerr << "Analyzed " << analyzed << " positions (" << skipped << " skipped) in " << ms << " ms, "
+              << total_nodes << " nodes, NPS: " << nps << "\n";
+    return analyzed;
+}
+
+// Runs a batch analysis from "--input F [--output F] [--format json|csv] [--depth D] [--movetime MS] [--threads N] [--hash MB]"
+long long analyze_command(const std::vector<std::string>& args){
+    const char* usage = "usage: chess_cli analyze --input FILE [--output FILE] [--format json|csv] [--depth D] [--movetime MS] [--threads N] [--hash MB]\n";
+    AnalyzeOptions opts;
+    for(size_t i = 0; i < args.size(); i += 2){
+        const std::string& key = args[i];
+        if(i + 1 == args.size()){
+            std::cerr << "Missing value for " << key << "\n" << usage;
+            return -1;
+        }
+        const std::string& value = args[i + 1];
+        try{
+            if(key == "--input") opts.input = value;
+            else if(key == "--output") opts.output = value;
+            else if(key == "--format") opts.format = value;
+            else if(key == "--depth") opts.depth = std::clamp(std::stoi(value), 1, MAX_PLY - 1);
+            else if(key == "--movetime") opts.movetime_ms = std::max(0, std::stoi(value));
+            else if(key == "--threads") opts.threads = std::clamp(std::stoi(value), 1, MAX_THREADS);
+            else if(key == "--hash") opts.hash_mb = std::clamp(std::stoi(value), 1, MAX_HASH_MB);
+            else std::cerr << "Unknown option " << key << "\n";
+        }
+        catch(const std::exception&){
+            std::cerr << "Invalid value " << value << " for " << key << "\n" << usage;
+            return -1;
+        }
+    }
+    if(opts.input.empty() || (opts.format != "json" && opts.format != "csv")){
+        std::cerr << usage;
+        return -1;
+    }
+    return run_analyze(opts);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <string>
+#include <vector>
+
+static constexpr int ANALYZE_DEPTH = 10;
+static constexpr int ANALYZE_HASH_MB = 64;
+
+// Options of a batch analysis run
+struct AnalyzeOptions {
+    std::string input;            // EPD or FEN file, one position per line
+    std::string output;           // result file; empty writes to stdout
+    std::string format = "json";  // "json" (one object per line) or "csv"
+    int depth = ANALYZE_DEPTH;
+    int movetime_ms = 0;          // > 0 caps the time spent on each position
+    int threads = 1;              // number of workers, each searching its own position
+    int hash_mb = ANALYZE_HASH_MB; // total hash, split evenly between the workers
+};
+
+// Streams every position of the input file through a pool of single-threaded searches and writes one result line per position
+// Results are written as soon as a position is done, so they come out in completion order; each line carries its input index
+// Returns the number of positions analyzed, or -1 if a file could not be opened
+long long run_analyze(const AnalyzeOptions& opts);
+
+// Runs a batch analysis from "--input F [--output F] [--format json|csv] [--depth D] [--movetime MS] [--threads N] [--hash MB]"
+long long analyze_command(const std::vector<std::string>& args);
@@ -0,0 +1,111 @@
+#include <cstdint>
+#include "attacks.h"
+#include "constants.h"
+#include "move_gen.h"
+
+Magic bishop_magics[64];
+Magic rook_magics[64];
+Bitboard between_bb[64][64];
+Bitboard line_bb[64][64];
+
+// Shared attack tables, sized for the sum of 2^popcount(mask) over all squares
+static Bitboard bishop_table[0x1480];
+static Bitboard rook_table[0x19000];
+
+// xorshift64* PRNG used for the magic search; seeded per rank so the search terminates quickly and deterministically
+// https://www.chessprogramming.org/Looking_for_Magics#Feeding_in_Randoms
+struct MagicRNG {
+    uint64_t s;
+
+    explicit MagicRNG(uint64_t seed) : s(seed) {}
+
+    uint64_t next() {
+        s ^= s >> 12, s ^= s << 25, s ^= s >> 27;
+        return s * 2685821657736338717ULL;
+    }
+
+    // Candidates with few set bits are far more likely to be valid magics
+    uint64_t sparse() { return next() & next() & next(); }
+};
+
+// Fills the magic entries for one slider type
+// Each square's attack sets are generated by the reference ray walker for every subset of its relevant occupancy,
+// then (without PEXT) a sparse random multiplier is searched for that maps all subsets without destructive collisions
+// https://www.chessprogramming.org/Looking_for_Magics
+static void init_magics(Magic magics[64], Bitboard* table, Bitboard (*ref_attacks)(uint8_t, Bitboard)){
+    Bitboard* next = table;
+#ifndef USE_PEXT
+    Bitboard occupancy[4096], reference[4096];
+    static const uint64_t seeds[8] = {728, 10316, 55079, 32803, 12281, 15100, 16645, 255};
+    int epoch[4096] = {}, attempt = 0;
+#endif
+
+    for(int sq = A1; sq <= H8; sq++){
+        Magic& m = magics[sq];
+
+        // board edges are irrelevant to blockers unless the slider is on them
+        Bitboard edges = ((rank_1_bb | rank_8_bb) & ~(rank_1_bb << (8 * get_rank(sq)))) |
+                         ((file_a_bb | file_h_bb) & ~(file_a_bb << get_file(sq)));
+        m.mask = ref_attacks(sq, 0) & ~edges;
+        m.shift = 64 - popcount(m.mask);
+        m.attacks = next;
+
+        // enumerate all subsets of the mask (Carry-Rippler)
+        int size = 0;
+        Bitboard b = 0;
+        do{
+#ifdef USE_PEXT
+            m.attacks[m.index(b)] = ref_attacks(sq, b);
+#else
+            occupancy[size] = b;
+            reference[size] = ref_attacks(sq, b);
+#endif
+            size++;
+            b = (b - m.mask) & m.mask;
+        } while(b);
+        next += size;
+
+#ifndef USE_PEXT
+        // try random sparse candidates until one indexes every subset consistently
+        MagicRNG rng(seeds[get_rank(sq)]);
+        for(int i = 0; i < size; ){
+            for(m.magic = 0; popcount((m.magic * m.mask) >> 56) < 6; )
+                m.magic = rng.sparse();
+
+            for(++attempt, i = 0; i < size; i++){
+                unsigned idx = m.index(occupancy[i]);
+                if(epoch[idx] < attempt){
+                    epoch[idx] = attempt;
+                    m.attacks[idx] = reference[i];
+                }
+                else if(m.attacks[idx] != reference[i]){
+                    break;
+                }
+            }
+        }
+#endif
+    }
+}
+
+// Build the slider attack and line tables; must be called once at startup before any move generation
+void init_attacks(){
+    init_magics(bishop_magics, bishop_table, bishop_move_ref);
+    init_magics(rook_magics, rook_table, rook_move_ref);
+
+    // two squares are aligned if a slider on one sees the other on an empty board;
+    // the squares between them are where both sliders' rays overlap with each other as blockers
+    for(int a = A1; a <= H8; a++){
+        for(int b = A1; b <= H8; b++){
+            Bitboard a_bb = 1ULL << a, b_bb = 1ULL << b;
+            between_bb[a][b] = line_bb[a][b] = 0;
+            if(bishop_attacks(a, 0) & b_bb){
+                line_bb[a][b] = (bishop_attacks(a, 0) & bishop_attacks(b, 0)) | a_bb | b_bb;
+                between_bb[a][b] = bishop_attacks(a, b_bb) & bishop_attacks(b, a_bb);
+            }
+            else if(rook_attacks(a, 0) & b_bb){
+                line_bb[a][b] = (rook_attacks(a, 0) & rook_attacks(b, 0)) | a_bb | b_bb;
+                between_bb[a][b] = rook_attacks(a, b_bb) & rook_attacks(b, a_bb);
+            }
+        }
+    }
+}
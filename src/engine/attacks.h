@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include "constants.h"
+
+#ifdef USE_PEXT
+#include <immintrin.h>
+#endif
+
+// Attack set of a piece that jumps by fixed (rank, file) steps, dropping any step that leaves the board
+constexpr Bitboard leaper_attacks(int square, const int (*steps)[2], int count){
+    Bitboard b = 0;
+    for(int i = 0; i < count; i++){
+        int rank = square / 8 + steps[i][0];
+        int file = square % 8 + steps[i][1];
+        if(rank >= 0 && rank < 8 && file >= 0 && file < 8)
+            b |= 1ULL << (rank * 8 + file);
+    }
+    return b;
+}
+
+// Builds a [64] leaper attack table at compile time
+constexpr std::array<Bitboard, 64> leaper_table(const int (*steps)[2], int count){
+    std::array<Bitboard, 64> table{};
+    for(int sq = A1; sq <= H8; sq++)
+        table[sq] = leaper_attacks(sq, steps, count);
+    return table;
+}
+
+constexpr int KNIGHT_STEPS[8][2] = {{-2, -1}, {-2, 1}, {-1, -2}, {-1, 2}, {1, -2}, {1, 2}, {2, -1}, {2, 1}};
+constexpr int KING_STEPS[8][2]   = {{-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1}};
+constexpr int PAWN_STEPS[2][2][2] = {
+    {{1, -1}, {1, 1}},   // white captures towards rank 8
+    {{-1, -1}, {-1, 1}}  // black captures towards rank 1
+};
+
+// Precomputed leaper attacks, generated at compile time
+// PAWN_ATTACKS[color][sq] holds the capture squares of a pawn of that color; PAWN_ATTACKS[!color][sq] gives the squares a pawn of color attacks sq from
+inline constexpr std::array<Bitboard, 64> KNIGHT_ATTACKS = leaper_table(KNIGHT_STEPS, 8);
+inline constexpr std::array<Bitboard, 64> KING_ATTACKS = leaper_table(KING_STEPS, 8);
+inline constexpr std::array<std::array<Bitboard, 64>, 2> PAWN_ATTACKS = {
+    leaper_table(PAWN_STEPS[WHITE], 2),
+    leaper_table(PAWN_STEPS[BLACK], 2)
+};
+
+// Magic bitboard entry for a single square; maps a blocker configuration to a precomputed attack set
+// Built with BMI2 (make PEXT=1), the index is taken directly with _pext_u64 and the magic multiplier is unused
+// https://www.chessprogramming.org/Magic_Bitboards
+// https://www.chessprogramming.org/BMI2#PEXTBitboards
+struct Magic {
+    Bitboard mask = 0;            // relevant occupancy: the slider's rays without the board edges
+    Bitboard magic = 0;           // multiplier that perfectly hashes every subset of mask
+    Bitboard* attacks = nullptr;  // this square's slice of the shared attack table
+    unsigned shift = 0;           // 64 - popcount(mask)
+
+    // Index into attacks for a given board occupancy
+    unsigned index(Bitboard occupancy) const {
+#ifdef USE_PEXT
+        return unsigned(_pext_u64(occupancy, mask));
+#else
+        return unsigned(((occupancy & mask) * magic) >> shift);
+#endif
+    }
+};
+
+extern Magic bishop_magics[64];
+extern Magic rook_magics[64];
+
+// between_bb[a][b]: squares strictly between a and b if they share a rank, file or diagonal, otherwise empty
+// line_bb[a][b]: the full board-spanning line through a and b if they are aligned, otherwise empty
+extern Bitboard between_bb[64][64];
+extern Bitboard line_bb[64][64];
+
+// Build the slider attack and line tables; must be called once at startup before any move generation
+void init_attacks();
+
+// Bishop attacks from a square given the board occupancy, assuming no friendlies
+inline Bitboard bishop_attacks(uint8_t square, Bitboard occupancy) {
+    const Magic& m = bishop_magics[square];
+    return m.attacks[m.index(occupancy)];
+}
+
+// Rook attacks from a square given the board occupancy, assuming no friendlies
+inline Bitboard rook_attacks(uint8_t square, Bitboard occupancy) {
+    const Magic& m = rook_magics[square];
+    return m.attacks[m.index(occupancy)];
+}
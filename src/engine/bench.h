@@ -0,0 +1,18 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+static constexpr int BENCH_DEPTH = 9;
+static constexpr int BENCH_HASH_MB = 16;
+
+// Fixed suite of positions searched by the bench; also the position corpus of the micro-benchmarks
+extern const std::vector<std::string> BENCH_FENS;
+
+// Searches a fixed suite of positions to a fixed depth and prints the total nodes, time and NPS
+// along with a signature of every position's node count and best move; returns the total node count
+// With a single thread the signature is deterministic, so any change in it means the search changed
+uint64_t run_bench(int depth = BENCH_DEPTH, int threads = 1, int hash_mb = BENCH_HASH_MB);
+
+// Runs the bench from positional arguments "[depth] [threads] [hash]", as given to the bench command or on the command line
+uint64_t bench_command(const std::vector<std::string>& args);
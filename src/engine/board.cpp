@@ -10,6 +10,7 @@
 #include "constants.h"
 #include "uci.h"
 #include "zobrist.h"
+#include "eval.h"
 
 Bitboard castle_path[4] = {3ULL << F1, 7ULL << B1, 3ULL << F8, 7ULL << B8}; // W_OO, W_OOO, B_OO, B_OOO
 
@@ -99,8 +100,9 @@ void print_board(Board board){
 }
 
 // Generate and print the legal movelist for the given Board
-void print_moves(Board& board, StateStack& ss){
-    std::vector<Move> movelist = generate_moves(board, ss);
+void print_moves(Board& board){
+    MoveList movelist;
+    generate_moves(board, movelist);
     std::cout << movelist.size() << " MOVES:\n";
     for(Move i : movelist){
         std::cout << move_to_uci(i) << ", flag=" << std::bitset<2>(get_move_flags(i));
@@ -255,12 +257,14 @@ Board get_board(std::string fen){
     board.st = &board.root;
     std::vector<std::string> fen_tokens = fen_parse(fen);
     get_bb_from_fen_pieces(fen_tokens[0], board);
+    fill_mailbox(board);
     get_turn_from_fen(fen_tokens[1], board);
     get_castle_from_fen(fen_tokens[2], board);
     get_en_passant_from_fen(fen_tokens[3], board);
     get_moves_from_fen(fen_tokens[4], fen_tokens[5], board);
 
     board.st->zobrist = compute_zobrist(board);
+    compute_psqt(board, *board.st);
     
     return board;
 }
@@ -339,10 +343,43 @@ bool empty_square(uint8_t square, Board& board){
 
 // Get the piece that is on a certain square, if any
 uint8_t piece_on_square(Board& board, uint8_t color, uint8_t sq) {
-    uint64_t m = 1ULL << sq;
-    for (uint8_t pt = PAWN; pt <= KING; pt++)
-        if (board.bb_pieces[color][pt] & m) return pt;
-    return NONE;
+    return (board.bb_colors[color] >> sq & 1) ? board.mailbox[sq] : uint8_t(NONE);
+}
+
+// Rebuild the mailbox from the piece bitboards
+void fill_mailbox(Board& board){
+    board.mailbox.fill(NONE);
+    for(int color = WHITE; color <= BLACK; color++){
+        for(int piece = PAWN; piece <= KING; piece++){
+            Bitboard bb = board.bb_pieces[color][piece];
+            while(bb){
+                board.mailbox[pop_lsb(bb)] = piece;
+            }
+        }
+    }
+}
+
+// Debug check that the mailbox and color bitboards agree with the piece bitboards
+// Every square must hold exactly the piece found in the bitboards, and no square may be claimed by two pieces
+bool board_consistent(const Board& board){
+    for(int color = WHITE; color <= BLACK; color++){
+        Bitboard all = 0;
+        for(int piece = PAWN; piece <= KING; piece++){
+            if(all & board.bb_pieces[color][piece]) return false;
+            all |= board.bb_pieces[color][piece];
+        }
+        if(all != board.bb_colors[color]) return false;
+    }
+    if(board.bb_colors[WHITE] & board.bb_colors[BLACK]) return false;
+
+    for(int sq = A1; sq <= H8; sq++){
+        uint8_t expected = NONE;
+        for(int color = WHITE; color <= BLACK; color++)
+            for(int piece = PAWN; piece <= KING; piece++)
+                if(board.bb_pieces[color][piece] >> sq & 1) expected = piece;
+        if(board.mailbox[sq] != expected) return false;
+    }
+    return true;
 }
 
 // Get the piece that is being captured by a move
@@ -20,6 +20,9 @@ struct BoardState {
     uint8_t captured_piece = NONE;   // Pieces or NONE
     uint8_t captured_square = 64;  // where the captured piece was removed/restored
     uint64_t zobrist = 0;
+    int mg_psqt = 0;   // midgame material + PST sum, white minus black; updated incrementally in do_move
+    int eg_psqt = 0;   // endgame material + PST sum, white minus black
+    int phase = 0;     // unclamped game phase from the remaining pieces
     BoardState* previous = nullptr;
 };
 
@@ -27,14 +30,29 @@ struct BoardState {
 struct Board {
     std::array<std::array<Bitboard, 6>, 2> bb_pieces{};
     std::array<Bitboard, 2> bb_colors{};
+    std::array<uint8_t, 64> mailbox;   // piece type on each square or NONE, kept in sync with bb_pieces for O(1) lookup
     uint8_t to_move;
     BoardState root;
     BoardState* st = nullptr;
 };
 
+#ifdef COPY_MAKE
+// Piece placement saved before every move when built with "make COPY_MAKE=1"
+// undo_move then copies it back instead of XOR-undoing the move
+// https://www.chessprogramming.org/Copy-Make
+struct BoardSnapshot {
+    std::array<std::array<Bitboard, 6>, 2> bb_pieces;
+    std::array<Bitboard, 2> bb_colors;
+    std::array<uint8_t, 64> mailbox;
+};
+#endif
+
 // Stack used for searching
 struct StateStack {
     std::array<BoardState, MAX_PLY> states;
+#ifdef COPY_MAKE
+    std::array<BoardSnapshot, MAX_PLY> snapshots; // snapshots[ply] is the placement before the move played from that ply
+#endif
     int ply = 0;
 };
 
@@ -62,7 +80,7 @@ void print_bitboard(Bitboard bitboard);
 void print_board(Board board);
 
 // Generate and print the legal movelist for the given Board
-void print_moves(Board& board, StateStack& ss);
+void print_moves(Board& board);
 
 // Parse a FEN string into its 6 constituent parts
 std::vector<std::string> fen_parse(std::string fen);
@@ -128,9 +146,15 @@ uint8_t parse_promotion_flag(Move move);
 // Check if a square is empty
 bool empty_square(uint8_t square, Board& board);
 
-// Get the piece that is on a square
+// Get the piece of a given color that is on a square, or NONE
 uint8_t piece_on_square(Board& board, uint8_t color, uint8_t sq);
 
+// Rebuild the mailbox from the piece bitboards
+void fill_mailbox(Board& board);
+
+// Debug check that the mailbox and color bitboards agree with the piece bitboards
+bool board_consistent(const Board& board);
+
 uint8_t get_captured_piece(Board& board, Move m);
 
 // Prints all bitboards of a Board
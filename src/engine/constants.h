@@ -5,6 +5,7 @@
 #define LAST_BIT 63
 
 constexpr int MAX_HISTORY = 16384;
+constexpr int MAX_MOVES = 256; // upper bound on legal moves in any position (the known maximum is 218)
 
 using Bitboard = uint64_t;
 using Move = uint16_t;
@@ -179,18 +179,47 @@ void init_pst(){
     }
 }
 
+// phase is determined by number of pieces on the board
+// pawn = 0, bishop/knight = 1, rook = 2, queen = 4, king = 0
+// higher phase = closer to midgame, lower phase = closer to endgame
+// this lets us transition from midgame to endgame
+const int phase_increment[6] = {0, 1, 1, 2, 4, 0};
+
+// Computes the PST sums and game phase of a position from scratch into st
+// do_move keeps these up to date by delta afterwards, so this only runs when a position is set up
+void compute_psqt(const Board& b, BoardState& st){
+    st.mg_psqt = st.eg_psqt = st.phase = 0;
+    for(int c = WHITE; c <= BLACK; c++){
+        for(int p = PAWN; p <= KING; p++){
+            Bitboard bb = b.bb_pieces[c][p];
+            while(bb){
+                update_psqt(st, c, p, pop_lsb(bb), 1);
+            }
+        }
+    }
+}
+
 // Returns an integer evaluation measured in centipawns using piece-square tables and interpolation between midgame and endgame
 // Positive values refer to a white advantage, while negative values refer to a black advantage
+// The PST sums and phase are maintained incrementally in the BoardState, so this is O(1)
 // https://www.chessprogramming.org/Piece-Square_Tables
+// https://www.chessprogramming.org/Incremental_Updates
 int evaluate(const Board& b) {
+    int mg_phase = game_phase(b);
+    int eg_phase = 24 - mg_phase;
+    return ( (b.st->mg_psqt * mg_phase) + (b.st->eg_psqt * eg_phase) ) / 24;
+}
+
+// Returns the game phase based on number of pieces
+// Higher values are closer to midgame, whereas lower values are closer to endgame
+int game_phase(const Board& b){
+    return b.st->phase > 24 ? 24 : b.st->phase; // max should be 24 in case of early promotion
+}
+
+// Reference evaluation that loops over every piece; slow, but used to verify the incremental PST sums
+int evaluate_ref(const Board& b) {
     int midgame[2] = {0, 0};
     int endgame[2] = {0, 0};
-
-    // phase is determined by number of pieces on the board
-    // pawn = 0, bishop/knight = 1, rook = 2, queen = 4, king = 0
-    // higher phase = closer to midgame, lower phase = closer to endgame
-    // this lets us transition from midgame to endgame
-    int phase_increment[6] = {0, 1, 1, 2, 4, 0}; 
     int phase = 0;
 
     for(int c = WHITE; c <= BLACK; c++){
@@ -206,7 +235,7 @@ int evaluate(const Board& b) {
     }
 
     // interp between mid/end game
-    if(phase > 24) phase = 24; // max should be 24 in case of early promotion
+    if(phase > 24) phase = 24;
     int mg_score = midgame[WHITE] - midgame[BLACK]; // + = white ahead, - = black ahead; we are not doing from-side perspective
     int eg_score = endgame[WHITE] - endgame[BLACK];
     int mg_phase = phase;
@@ -214,22 +243,12 @@ int evaluate(const Board& b) {
     return ( (mg_score * mg_phase) + (eg_score * eg_phase) ) / 24;
 }
 
-// Returns the game phase based on number of pieces
-// Higher values are closer to midgame, whereas lower values are closer to endgame
-int game_phase(const Board& b){
-    int phase_increment[6] = {0, 1, 1, 2, 4, 0}; 
-    int phase = 0;
-    for(int c = WHITE; c <= BLACK; c++){
-        for(int p = PAWN; p <= KING; p++){
-            Bitboard bb = b.bb_pieces[c][p];
-            while(bb){
-                pop_lsb(bb);
-                phase += phase_increment[p];
-            }
-        }
-    }
-    if(phase > 24) phase = 24;
-    return phase;
+// Returns 1 if the incremental PST sums and phase of the current state differ from a full recompute, 0 otherwise
+int verify_eval(const Board& b){
+    BoardState ref;
+    compute_psqt(b, ref);
+    if(ref.mg_psqt != b.st->mg_psqt || ref.eg_psqt != b.st->eg_psqt || ref.phase != b.st->phase) return 1;
+    return evaluate(b) != evaluate_ref(b);
 }
 
 // Returns piece values based on phase for delta pruning, where we prune captures that are extremely unlikely to improve the position
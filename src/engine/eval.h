@@ -3,9 +3,25 @@
 #include "constants.h"
 #include "move_gen.h"
 
+extern int mg_table[2][6][64];
+extern int eg_table[2][6][64];
+extern const int phase_increment[6];
+
 // Initialize piece square lookup tables
 void init_pst();
 
+// Computes the PST sums and game phase of a position from scratch into st
+// Requires that the PSTs have been initialized
+void compute_psqt(const Board& b, BoardState& st);
+
+// Adds (sign = 1) or removes (sign = -1) a piece's contribution to the incremental PST sums and phase
+inline void update_psqt(BoardState& st, uint8_t color, uint8_t piece, uint8_t sq, int sign){
+    int s = (color == WHITE) ? sign : -sign;
+    st.mg_psqt += s * mg_table[color][piece][sq];
+    st.eg_psqt += s * eg_table[color][piece][sq];
+    st.phase += sign * phase_increment[piece];
+}
+
 // Aggregate evaluation; + means white is better, - means black is better
 int evaluate(const Board& b);
 
@@ -13,4 +29,10 @@ int evaluate(const Board& b);
 int game_phase(const Board& b);
 
 // Returns a piece value with game phase interpolation for delta pruning
-int delta_piece_value(int piece, int phase);
\ No newline at end of file
+int delta_piece_value(int piece, int phase);
+
+// Reference evaluation that loops over every piece; slow, but used to verify the incremental PST sums
+int evaluate_ref(const Board& b);
+
+// Returns 1 if the incremental PST sums and phase of the current state differ from a full recompute, 0 otherwise
+int verify_eval(const Board& b);
@@ -11,9 +11,21 @@
 #include "eval.h"
 #include "search.h"
 #include "zobrist.h"
+#include "attacks.h"
+#include "bench.h"
+#include "analyze.h"
 
-int main(void){
+// "chess_cli bench [depth] [threads] [hash]" runs the bench suite and exits
+// "chess_cli analyze --input FILE ..." analyzes every position of an EPD or FEN file and exits; otherwise starts the UCI loop
+int main(int argc, char* argv[]){
     Zobrist::init();
+    init_attacks();
     init_pst();
+    if(argc > 1 && std::string(argv[1]) == "bench"){
+        bench_command(std::vector<std::string>(argv + 2, argv + argc));
+        return 0;
+    }
+    if(argc > 1 && std::string(argv[1]) == "analyze")
+        return analyze_command(std::vector<std::string>(argv + 2, argv + argc)) < 0 ? 1 : 0;
     return run_uci_loop();
 }
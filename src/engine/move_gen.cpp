@@ -1,57 +1,32 @@
 #include <cmath>
 #include <cassert>
+#include <algorithm>
 #include "move_gen.h"
+#include "attacks.h"
 #include "board.h"
 #include "constants.h"
 #include "search.h"
 #include "zobrist.h"
+#include "eval.h"
 
-// Generates king attack bitboard, assuming no friendlies
+// Generates king attack bitboard from the precomputed table, assuming no friendlies
 Bitboard king_move(uint8_t square){ 
-    Bitboard b = 0;
-    for(int i : {-9, -8, -7, -1, 1, 7, 8, 9}){
-        b |= check_dst(square, i);
-    }
-    return b;
+    return KING_ATTACKS[square];
 }
 
-// Generates knight attack bitboard, assuming no friendlies
+// Generates knight attack bitboard from the precomputed table, assuming no friendlies
 Bitboard knight_move(uint8_t square){
-    Bitboard b = 0;
-    for(int i : {-17, -15, -10, -6, 6, 10, 15, 17}){
-        b |= check_dst(square, i);
-    }
-    return b;
+    return KNIGHT_ATTACKS[square];
 }
 
-// Generates bishop attack bitboard, assuming no friendlies
+// Generates bishop attack bitboard from the magic bitboard tables, assuming no friendlies
 Bitboard bishop_move(uint8_t square, Bitboard occupancy){
-    Bitboard b = 0;
-    for(int i : {-9, -7, 7, 9}){
-        uint8_t s = square;
-        while(check_dst(s, i)){
-            b |= (1ULL << (s += i));
-            if(occupancy & (1ULL << s)){
-                break;
-            }
-        }
-    }
-    return b;
+    return bishop_attacks(square, occupancy);
 }
 
-// Generates rook attack bitboard, assuming no friendlies
+// Generates rook attack bitboard from the magic bitboard tables, assuming no friendlies
 Bitboard rook_move(uint8_t square, Bitboard occupancy){
-    Bitboard b = 0;
-    for(int i : {-8, -1, 1, 8}){
-        uint8_t s = square;
-        while(check_dst(s, i)){
-            b |= (1ULL << (s += i));
-            if(occupancy & (1ULL << s)){
-                break;
-            }
-        }
-    }
-    return b;
+    return rook_attacks(square, occupancy);
 }
 
 // Generates queen attack bitboard, assuming no friendlies
@@ -65,11 +40,10 @@ Bitboard pawn_move(uint8_t square, Board& board, uint8_t color){
     Bitboard moves = 0ULL;
     if(color == WHITE){
         // capture
-        moves |= check_dst(square, 7) & (board.bb_colors[BLACK]);
-        moves |= check_dst(square, 9) & (board.bb_colors[BLACK]);
+        moves |= PAWN_ATTACKS[WHITE][square] & (board.bb_colors[BLACK]);
         if (board.st->en_passant < 64) {
             Bitboard ep_bb = 1ULL << board.st->en_passant;
-            moves |= (check_dst(square, 7) | check_dst(square, 9)) & ep_bb;
+            moves |= PAWN_ATTACKS[WHITE][square] & ep_bb;
         }
 
         // single push
@@ -84,11 +58,10 @@ Bitboard pawn_move(uint8_t square, Board& board, uint8_t color){
     }
     else{
         // capture
-        moves |= check_dst(square, -7) & (board.bb_colors[WHITE]);
-        moves |= check_dst(square, -9) & (board.bb_colors[WHITE]);
+        moves |= PAWN_ATTACKS[BLACK][square] & (board.bb_colors[WHITE]);
         if (board.st->en_passant < 64) {
             Bitboard ep_bb = 1ULL << board.st->en_passant;
-            moves |= (check_dst(square, -7) | check_dst(square, -9)) & ep_bb;
+            moves |= PAWN_ATTACKS[BLACK][square] & ep_bb;
         }
 
         // single push
@@ -104,9 +77,54 @@ Bitboard pawn_move(uint8_t square, Board& board, uint8_t color){
     return moves;
 }
 
-// Generates a vector of pseudo-legal moves (basic movement, but not necessarily legal)
-std::vector<Move> generate_pseudo(Board& board, uint8_t color){
-    std::vector<Move> movelist;
+// Pushes the castling moves available to color; the king may not be in check or pass through or land on an attacked square
+static void push_castles(Board& board, uint8_t color, MoveList& movelist){
+    // kind of ugly hard coded solution
+    if(board.st->castle){ 
+        if((color == WHITE) && (board.bb_pieces[WHITE][KING] & (1ULL << E1))){
+            if( (board.st->castle & WHITE_OO) && (board.bb_pieces[WHITE][ROOK] & (1ULL << H1))){
+                if(!square_attacked(board, E1, BLACK) && !square_attacked(board, F1, BLACK) && !square_attacked(board, G1, BLACK) && !(castle_path[0] & (board.bb_colors[WHITE] | board.bb_colors[BLACK]))){
+                    movelist.push(set_move(E1, G1, CASTLE));
+                }
+            }
+            if( (board.st->castle & WHITE_OOO) && (board.bb_pieces[WHITE][ROOK] & (1ULL << A1))){
+                if(!square_attacked(board, E1, BLACK) && !square_attacked(board, D1, BLACK) && !square_attacked(board, C1, BLACK) && !(castle_path[1] & (board.bb_colors[WHITE] | board.bb_colors[BLACK]))){
+                    movelist.push(set_move(E1, C1, CASTLE));
+                }
+            }
+        }
+        else if((color == BLACK) && (board.bb_pieces[BLACK][KING] & (1ULL << E8))){
+            if( (board.st->castle & BLACK_OO) && (board.bb_pieces[BLACK][ROOK] & (1ULL << H8)) ){
+                if(!square_attacked(board, E8, WHITE) && !square_attacked(board, F8, WHITE) && !square_attacked(board, G8, WHITE) && !(castle_path[2] & (board.bb_colors[WHITE] | board.bb_colors[BLACK]))){
+                    movelist.push(set_move(E8, G8, CASTLE));
+                }
+            }
+            if( (board.st->castle & BLACK_OOO) && (board.bb_pieces[BLACK][ROOK] & (1ULL << A8))){
+                if(!square_attacked(board, E8, WHITE) && !square_attacked(board, D8, WHITE) && !square_attacked(board, C8, WHITE) && !(castle_path[3] & (board.bb_colors[WHITE] | board.bb_colors[BLACK]))){
+                    movelist.push(set_move(E8, C8, CASTLE));
+                }
+            }
+        }
+    }
+}
+
+// Pushes pawn moves from a square to each target square, expanding moves onto the last rank into all four promotions
+static void push_pawn_moves(MoveList& movelist, uint8_t from, Bitboard targets){
+    while(targets){
+        uint8_t to = pop_lsb(targets);
+        if(to >= A8 || to <= H1){
+            movelist.push(set_move(from, to, PROMOTION, KNIGHT));
+            movelist.push(set_move(from, to, PROMOTION, BISHOP));
+            movelist.push(set_move(from, to, PROMOTION, ROOK));
+            movelist.push(set_move(from, to, PROMOTION, QUEEN));
+        }
+        else movelist.push(set_move(from, to, NORMAL));
+    }
+}
+
+// Generates a list of pseudo-legal moves (basic movement, but not necessarily legal)
+void generate_pseudo(Board& board, uint8_t color, MoveList& movelist){
+    movelist.clear();
     uint8_t from, to;
     std::array<Bitboard, 6> pieces = board.bb_pieces[color];
     while(pieces[0]){
@@ -114,20 +132,20 @@ std::vector<Move> generate_pseudo(Board& board, uint8_t color){
         Bitboard pawn = pawn_move(from, board, color);
         while(pawn){
             to = pop_lsb(pawn);
-            if(to == board.st->en_passant) movelist.push_back(set_move(from, to, EN_PASSANT));
+            if(to == board.st->en_passant) movelist.push(set_move(from, to, EN_PASSANT));
             else if(to >= 56 && to <= 63 && color == WHITE){
-                movelist.push_back(set_move(from, to, PROMOTION, KNIGHT));
-                movelist.push_back(set_move(from, to, PROMOTION, BISHOP));
-                movelist.push_back(set_move(from, to, PROMOTION, ROOK));
-                movelist.push_back(set_move(from, to, PROMOTION, QUEEN));
+                movelist.push(set_move(from, to, PROMOTION, KNIGHT));
+                movelist.push(set_move(from, to, PROMOTION, BISHOP));
+                movelist.push(set_move(from, to, PROMOTION, ROOK));
+                movelist.push(set_move(from, to, PROMOTION, QUEEN));
             }
             else if(to <= 7 && color == BLACK){
-                movelist.push_back(set_move(from, to, PROMOTION, KNIGHT));
-                movelist.push_back(set_move(from, to, PROMOTION, BISHOP));
-                movelist.push_back(set_move(from, to, PROMOTION, ROOK));
-                movelist.push_back(set_move(from, to, PROMOTION, QUEEN));
+                movelist.push(set_move(from, to, PROMOTION, KNIGHT));
+                movelist.push(set_move(from, to, PROMOTION, BISHOP));
+                movelist.push(set_move(from, to, PROMOTION, ROOK));
+                movelist.push(set_move(from, to, PROMOTION, QUEEN));
             }
-            else movelist.push_back(set_move(from, to, NORMAL));
+            else movelist.push(set_move(from, to, NORMAL));
         }
     }
     while(pieces[1]){
@@ -135,7 +153,7 @@ std::vector<Move> generate_pseudo(Board& board, uint8_t color){
         Bitboard knight = knight_move(from) & ~board.bb_colors[color];
         while(knight){
             to = pop_lsb(knight);
-            movelist.push_back(set_move(from, to, NORMAL));
+            movelist.push(set_move(from, to, NORMAL));
         }
     }
     while(pieces[2]){
@@ -143,7 +161,7 @@ std::vector<Move> generate_pseudo(Board& board, uint8_t color){
         Bitboard bishop = bishop_move(from, board.bb_colors[0] | board.bb_colors[1]) & ~board.bb_colors[color];
         while(bishop){
             to = pop_lsb(bishop);
-            movelist.push_back(set_move(from, to, NORMAL));
+            movelist.push(set_move(from, to, NORMAL));
         }
     }
     while(pieces[3]){
@@ -151,7 +169,7 @@ std::vector<Move> generate_pseudo(Board& board, uint8_t color){
         Bitboard rook = rook_move(from, board.bb_colors[0] | board.bb_colors[1]) & ~board.bb_colors[color];
         while(rook){
             to = pop_lsb(rook);
-            movelist.push_back(set_move(from, to, NORMAL));
+            movelist.push(set_move(from, to, NORMAL));
         }
     }
     while(pieces[4]){
@@ -159,7 +177,7 @@ std::vector<Move> generate_pseudo(Board& board, uint8_t color){
         Bitboard queen = queen_move(from, board.bb_colors[0] | board.bb_colors[1]) & ~board.bb_colors[color];
         while(queen){
             to = pop_lsb(queen);
-            movelist.push_back(set_move(from, to, NORMAL));
+            movelist.push(set_move(from, to, NORMAL));
         }
     }
     while(pieces[5]){
@@ -167,63 +185,142 @@ std::vector<Move> generate_pseudo(Board& board, uint8_t color){
         Bitboard king = king_move(from) & ~board.bb_colors[color];
         while(king){
             to = pop_lsb(king);
-            movelist.push_back(set_move(from, to, NORMAL));
+            movelist.push(set_move(from, to, NORMAL));
         }
     }
-    // kind of ugly hard coded solution
-    if(board.st->castle){ 
-        if((color == WHITE) && (board.bb_pieces[WHITE][KING] & (1ULL << E1))){
-            if( (board.st->castle & WHITE_OO) && (board.bb_pieces[WHITE][ROOK] & (1ULL << H1))){
-                if(!square_attacked(board, E1, BLACK) && !square_attacked(board, F1, BLACK) && !square_attacked(board, G1, BLACK) && !(castle_path[0] & (board.bb_colors[WHITE] | board.bb_colors[BLACK]))){
-                    movelist.push_back(set_move(E1, G1, CASTLE));
-                }
-            }
-            if( (board.st->castle & WHITE_OOO) && (board.bb_pieces[WHITE][ROOK] & (1ULL << A1))){
-                if(!square_attacked(board, E1, BLACK) && !square_attacked(board, D1, BLACK) && !square_attacked(board, C1, BLACK) && !(castle_path[1] & (board.bb_colors[WHITE] | board.bb_colors[BLACK]))){
-                    movelist.push_back(set_move(E1, C1, CASTLE));
-                }
+    push_castles(board, color, movelist);
+}
+
+// Generates legal moves by computing checkers and pinned pieces once for the position, rather than playing each move out
+// In double check only the king may move; in single check other pieces must capture the checker or block its ray
+// GEN_EVASIONS is GEN_ALL for a position known to be in check, so the target is always limited to the checking ray
+// Pinned pieces may only move along the line through their king, and king moves are tested with the king lifted off the board
+// https://www.chessprogramming.org/Move_Generation#Legal
+// https://www.chessprogramming.org/Pin
+static void generate_legal(Board& board, MoveList& movelist, GenType type){
+    movelist.clear();
+    uint8_t us = board.to_move;
+    uint8_t them = !us;
+    uint8_t ksq = king_square(board, us);
+    uint8_t from, to;
+    Bitboard own = board.bb_colors[us];
+    Bitboard enemy = board.bb_colors[them];
+    Bitboard occ = own | enemy;
+    Bitboard checkers = attackers_to(board, ksq, occ) & enemy;
+    const std::array<Bitboard, 6>& pieces = board.bb_pieces[us];
+    assert(type != GEN_EVASIONS || checkers);
+
+    if(popcount(checkers) < 2){
+        Bitboard pinned = pinned_pieces(board, us);
+        Bitboard target = type == GEN_CAPTURES ? enemy : type == GEN_QUIETS ? ~occ : ~own;
+        if(checkers) target &= between_bb[ksq][lsb(checkers)] | checkers;
+
+        // pawns; en passant is handled separately below
+        Bitboard ep_bb = board.st->en_passant < 64 ? (1ULL << board.st->en_passant) : 0ULL;
+        Bitboard bb = pieces[PAWN];
+        while(bb){
+            from = pop_lsb(bb);
+            Bitboard moves = pawn_move(from, board, us) & ~ep_bb & target;
+            if(pinned & (1ULL << from)) moves &= line_bb[ksq][from];
+            push_pawn_moves(movelist, from, moves);
+        }
+
+        // en passant removes two pawns from the same rank at once, which can expose the king along that rank (or a diagonal),
+        // so each candidate is tested against the occupancy after the capture
+        if(ep_bb && type != GEN_QUIETS){
+            uint8_t ep = board.st->en_passant;
+            Bitboard cap_bb = 1ULL << (us == WHITE ? ep - 8 : ep + 8);
+            bb = PAWN_ATTACKS[them][ep] & pieces[PAWN];
+            while(bb){
+                from = pop_lsb(bb);
+                Bitboard occ_after = (occ ^ (1ULL << from) ^ cap_bb) | ep_bb;
+                if(!(attackers_to(board, ksq, occ_after) & enemy & ~cap_bb))
+                    movelist.push(set_move(from, ep, EN_PASSANT));
             }
         }
-        else if((color == BLACK) && (board.bb_pieces[BLACK][KING] & (1ULL << E8))){
-            if( (board.st->castle & BLACK_OO) && (board.bb_pieces[BLACK][ROOK] & (1ULL << H8)) ){
-                if(!square_attacked(board, E8, WHITE) && !square_attacked(board, F8, WHITE) && !square_attacked(board, G8, WHITE) && !(castle_path[2] & (board.bb_colors[WHITE] | board.bb_colors[BLACK]))){
-                    movelist.push_back(set_move(E8, G8, CASTLE));
-                }
+
+        // a pinned knight can never stay on its pin line
+        bb = pieces[KNIGHT] & ~pinned;
+        while(bb){
+            from = pop_lsb(bb);
+            Bitboard moves = knight_move(from) & target;
+            while(moves){
+                to = pop_lsb(moves);
+                movelist.push(set_move(from, to, NORMAL));
             }
-            if( (board.st->castle & BLACK_OOO) && (board.bb_pieces[BLACK][ROOK] & (1ULL << A8))){
-                if(!square_attacked(board, E8, WHITE) && !square_attacked(board, D8, WHITE) && !square_attacked(board, C8, WHITE) && !(castle_path[3] & (board.bb_colors[WHITE] | board.bb_colors[BLACK]))){
-                    movelist.push_back(set_move(E8, C8, CASTLE));
+        }
+
+        for(uint8_t pt : {BISHOP, ROOK, QUEEN}){
+            bb = pieces[pt];
+            while(bb){
+                from = pop_lsb(bb);
+                Bitboard moves = 0;
+                if(pt != ROOK) moves |= bishop_move(from, occ);
+                if(pt != BISHOP) moves |= rook_move(from, occ);
+                moves &= target;
+                if(pinned & (1ULL << from)) moves &= line_bb[ksq][from];
+                while(moves){
+                    to = pop_lsb(moves);
+                    movelist.push(set_move(from, to, NORMAL));
                 }
             }
         }
     }
-    return movelist;
+
+    // the king is lifted off the board so that it cannot hide behind itself along a checking ray
+    Bitboard moves = king_move(ksq) & (type == GEN_CAPTURES ? enemy : type == GEN_QUIETS ? ~occ : ~own);
+    Bitboard occ_no_king = occ ^ (1ULL << ksq);
+    while(moves){
+        to = pop_lsb(moves);
+        if(!(attackers_to(board, to, occ_no_king) & enemy))
+            movelist.push(set_move(ksq, to, NORMAL));
+    }
+
+    if(!checkers && type != GEN_CAPTURES) push_castles(board, us, movelist);
 }
 
 // Generate the list of legal moves in a position
-std::vector<Move> generate_moves(Board& board, StateStack& ss){
-    std::vector<Move> pseudo = generate_pseudo(board, board.to_move);
-    std::vector<Move> legal_moves;
-    legal_moves.reserve(pseudo.size());
-    for(Move m : pseudo){
-        if(legal(board, ss, m)){
-            legal_moves.push_back(m);
+void generate_moves(Board& board, MoveList& movelist){
+    generate_legal(board, movelist, GEN_ALL);
+}
+
+// Generate the list of legal captures (including en passant) in a position
+void generate_captures(Board& board, MoveList& movelist){
+    generate_legal(board, movelist, GEN_CAPTURES);
+}
+
+// Generate the list of legal non-captures (including castling and non-capturing promotions) in a position
+void generate_quiets(Board& board, MoveList& movelist){
+    generate_legal(board, movelist, GEN_QUIETS);
+}
+
+// Generate the list of legal moves out of check; the side to move must be in check
+void generate_evasions(Board& board, MoveList& movelist){
+    generate_legal(board, movelist, GEN_EVASIONS);
+}
+
+// Reference legal move generator: filters the pseudo-legal list in place by playing each move out with legal()
+void generate_moves_ref(Board& board, StateStack& ss, MoveList& movelist){
+    generate_pseudo(board, board.to_move, movelist);
+    int n = 0;
+    for(int i = 0; i < movelist.count; i++){
+        if(legal(board, ss, movelist[i])){
+            movelist[n++] = movelist[i];
         }
     }
-    return legal_moves;
+    movelist.count = n;
 }
 
-// Generate the list of legal captures in a position
-std::vector<Move> generate_captures(Board& board, StateStack& ss){
-    std::vector<Move> pseudo = generate_pseudo(board, board.to_move);
-    std::vector<Move> captures;
-    captures.reserve(pseudo.size());
-    for(Move m : pseudo){
-        if(legal(board, ss, m) && is_capture(board, m)){
-            captures.push_back(m);
+// Reference legal capture generator: filters the pseudo-legal list in place by playing each move out with legal()
+void generate_captures_ref(Board& board, StateStack& ss, MoveList& movelist){
+    generate_pseudo(board, board.to_move, movelist);
+    int n = 0;
+    for(int i = 0; i < movelist.count; i++){
+        if(is_capture(board, movelist[i]) && legal(board, ss, movelist[i])){
+            movelist[n++] = movelist[i];
         }
     }
-    return captures;
+    movelist.count = n;
 }
 
 // Plays a move, and pushes it onto the search stack
@@ -236,6 +333,10 @@ void do_move(Board& board, StateStack& ss, Move move){
     uint8_t old_ep = (board.st)->en_passant;
     assert(moved_piece != NONE);
 
+#ifdef COPY_MAKE
+    ss.snapshots[ss.ply] = {board.bb_pieces, board.bb_colors, board.mailbox};
+#endif
+
     // define a new board state & push onto stack
     BoardState* new_st = &ss.states[++ss.ply];
     new_st->previous   = board.st;
@@ -246,6 +347,9 @@ void do_move(Board& board, StateStack& ss, Move move){
     new_st->captured_piece  = NONE;
     new_st->captured_square = to;
     new_st->zobrist = board.st->zobrist;
+    new_st->mg_psqt = board.st->mg_psqt;
+    new_st->eg_psqt = board.st->eg_psqt;
+    new_st->phase   = board.st->phase;
 
     board.st = new_st;
 
@@ -263,7 +367,9 @@ void do_move(Board& board, StateStack& ss, Move move){
         Bitboard cap_bb = 1ULL << cap_sq;
         board.bb_pieces[!color][PAWN] ^= cap_bb;
         board.bb_colors[!color] ^= cap_bb;
+        board.mailbox[cap_sq] = NONE;
         (board.st)->zobrist ^= Zobrist::piece_sq[!color][PAWN][cap_sq];
+        update_psqt(*board.st, !color, PAWN, cap_sq, -1);
     }
     else if(capture){
         uint8_t cap_piece = piece_on_square(board, !color, to);
@@ -271,19 +377,27 @@ void do_move(Board& board, StateStack& ss, Move move){
         board.bb_pieces[!color][cap_piece] ^= to_bb;
         board.bb_colors[!color] ^= to_bb;
         (board.st)->zobrist ^= Zobrist::piece_sq[!color][cap_piece][to];
+        update_psqt(*board.st, !color, cap_piece, to, -1);
     }
     board.bb_pieces[color][moved_piece] ^= (from_bb | to_bb);
     board.bb_colors[color] ^= (from_bb | to_bb);
+    board.mailbox[from] = NONE;
+    board.mailbox[to] = moved_piece; // also overwrites a captured piece
     (board.st)->zobrist ^= Zobrist::piece_sq[color][moved_piece][from];
     (board.st)->zobrist ^= Zobrist::piece_sq[color][moved_piece][to];
+    update_psqt(*board.st, color, moved_piece, from, -1);
+    update_psqt(*board.st, color, moved_piece, to, 1);
 
     // handle promotions
     if(parse_promotion_flag(move) != NONE){
         uint8_t promo_piece = parse_promotion_flag(move);
         board.bb_pieces[color][PAWN] ^= to_bb;
         board.bb_pieces[color][promo_piece] ^= to_bb;
+        board.mailbox[to] = promo_piece;
         (board.st)->zobrist ^= Zobrist::piece_sq[color][PAWN][to];
         (board.st)->zobrist ^= Zobrist::piece_sq[color][promo_piece][to];
+        update_psqt(*board.st, color, PAWN, to, -1);
+        update_psqt(*board.st, color, promo_piece, to, 1);
     }
 
     // move rooks during castling
@@ -305,8 +419,12 @@ void do_move(Board& board, StateStack& ss, Move move){
                 board.bb_colors[WHITE] ^= (rook_from | rook_to);
             }
             if(rf != 64){
+                board.mailbox[rf] = NONE;
+                board.mailbox[rt] = ROOK;
                 (board.st)->zobrist ^= Zobrist::piece_sq[WHITE][ROOK][rf];
                 (board.st)->zobrist ^= Zobrist::piece_sq[WHITE][ROOK][rt];
+                update_psqt(*board.st, WHITE, ROOK, rf, -1);
+                update_psqt(*board.st, WHITE, ROOK, rt, 1);
             }
         }
         else{
@@ -325,8 +443,12 @@ void do_move(Board& board, StateStack& ss, Move move){
                 board.bb_colors[BLACK] ^= (rook_from | rook_to);
             }
             if(rf != 64){
+                board.mailbox[rf] = NONE;
+                board.mailbox[rt] = ROOK;
                 (board.st)->zobrist ^= Zobrist::piece_sq[BLACK][ROOK][rf];
                 (board.st)->zobrist ^= Zobrist::piece_sq[BLACK][ROOK][rt];
+                update_psqt(*board.st, BLACK, ROOK, rf, -1);
+                update_psqt(*board.st, BLACK, ROOK, rt, 1);
             }
         }
     }
@@ -352,11 +474,50 @@ void do_move(Board& board, StateStack& ss, Move move){
     (board.st)->zobrist ^= Zobrist::side_to_move;
 }
 
+// Returns the Zobrist key of the position after a move without playing it, for prefetching the child's TT bucket
+// Covers moved, captured and promoted pieces, en passant and side to move; changes to castling rights are ignored,
+// so the key is occasionally wrong, which only costs a wasted prefetch
+uint64_t key_after(Board& board, Move move){
+    uint8_t color = board.to_move;
+    uint8_t from = get_from_sq(move);
+    uint8_t to = get_to_sq(move);
+    uint8_t flag = get_move_flags(move);
+    uint8_t moved_piece = piece_on_square(board, color, from);
+    uint64_t key = board.st->zobrist ^ Zobrist::side_to_move;
+
+    if(board.st->en_passant != 64) key ^= Zobrist::ep_file[get_file(board.st->en_passant)];
+    if(flag == (CASTLE >> 14)) return key; // rook and rights updates ignored
+
+    uint8_t placed = parse_promotion_flag(move) != NONE ? parse_promotion_flag(move) : moved_piece;
+    key ^= Zobrist::piece_sq[color][moved_piece][from] ^ Zobrist::piece_sq[color][placed][to];
+
+    if(flag == (EN_PASSANT >> 14)){
+        key ^= Zobrist::piece_sq[!color][PAWN][color == WHITE ? to - 8 : to + 8];
+    }
+    else{
+        uint8_t captured = piece_on_square(board, !color, to);
+        if(captured != NONE) key ^= Zobrist::piece_sq[!color][captured][to];
+    }
+    if(moved_piece == PAWN && (from ^ to) == 16) key ^= Zobrist::ep_file[get_file(from)];
+    return key;
+}
+
 // Reverts a move to the previous position on the stack. 
 // Note that the move parameter assumes that the exact correct move is put in, but this should be fine as we only really want to do this during searching so we'll know the exact move
 void undo_move(Board& board, StateStack& ss, Move move){
     // reset side
     board.to_move ^= 1;
+
+#ifdef COPY_MAKE
+    // restore the placement saved by do_move and pop BoardState
+    const BoardSnapshot& snap = ss.snapshots[--ss.ply];
+    board.bb_pieces = snap.bb_pieces;
+    board.bb_colors = snap.bb_colors;
+    board.mailbox = snap.mailbox;
+    board.st = board.st->previous;
+    return;
+#endif
+
     uint8_t color = board.to_move;
     uint8_t from = get_from_sq(move);
     uint8_t to = get_to_sq(move);
@@ -371,12 +532,16 @@ void undo_move(Board& board, StateStack& ss, Move move){
                 Bitboard rook_to = 1ULL << F1;
                 board.bb_pieces[WHITE][ROOK] ^= (rook_from | rook_to);
                 board.bb_colors[WHITE] ^= (rook_from | rook_to);
+                board.mailbox[H1] = ROOK;
+                board.mailbox[F1] = NONE;
             }
             else if (to == C1){
                 Bitboard rook_from = 1ULL << A1;
                 Bitboard rook_to = 1ULL << D1;
                 board.bb_pieces[WHITE][ROOK] ^= (rook_from | rook_to);
                 board.bb_colors[WHITE] ^= (rook_from | rook_to);
+                board.mailbox[A1] = ROOK;
+                board.mailbox[D1] = NONE;
             }
         }
         else{
@@ -385,12 +550,16 @@ void undo_move(Board& board, StateStack& ss, Move move){
                 Bitboard rook_to = 1ULL << F8;
                 board.bb_pieces[BLACK][ROOK] ^= (rook_from | rook_to);
                 board.bb_colors[BLACK] ^= (rook_from | rook_to);
+                board.mailbox[H8] = ROOK;
+                board.mailbox[F8] = NONE;
             }
             else if (to == C8){
                 Bitboard rook_from = 1ULL << A8;
                 Bitboard rook_to = 1ULL << D8;
                 board.bb_pieces[BLACK][ROOK] ^= (rook_from | rook_to);
                 board.bb_colors[BLACK] ^= (rook_from | rook_to);
+                board.mailbox[A8] = ROOK;
+                board.mailbox[D8] = NONE;
             }
         }
     }
@@ -400,18 +569,22 @@ void undo_move(Board& board, StateStack& ss, Move move){
         uint8_t promo_piece = parse_promotion_flag(move);
         board.bb_pieces[color][PAWN] ^= to_bb;
         board.bb_pieces[color][promo_piece] ^= to_bb;
+        board.mailbox[to] = PAWN;
     }
 
     // undo move
     uint8_t moved_piece = piece_on_square(board, color, to);
     board.bb_pieces[color][moved_piece] ^= (from_bb | to_bb);
     board.bb_colors[color] ^= (from_bb | to_bb);
+    board.mailbox[from] = moved_piece;
+    board.mailbox[to] = NONE;
     
     // restore captured piece
     if (board.st->captured_piece != NONE) {
         uint64_t cap_bb = 1ULL << board.st->captured_square;
         board.bb_pieces[!color][board.st->captured_piece] ^= cap_bb;
         board.bb_colors[!color] ^= cap_bb;
+        board.mailbox[board.st->captured_square] = board.st->captured_piece;
     }
 
     // pop BoardState
@@ -419,6 +592,30 @@ void undo_move(Board& board, StateStack& ss, Move move){
     ss.ply--;
 }
 
+// Passes the turn without moving a piece, for null-move pruning; only the side to move and en passant change
+// halfmove restarts at 0 so that repetition detection never looks past the null move
+// https://www.chessprogramming.org/Null_Move
+void do_null_move(Board& board, StateStack& ss){
+    BoardState* new_st = &ss.states[++ss.ply];
+    *new_st = *board.st;
+    new_st->previous = board.st;
+    new_st->en_passant = 64;
+    new_st->halfmove = 0;
+    new_st->captured_piece = NONE;
+    new_st->captured_square = 64;
+    if (board.st->en_passant != 64) new_st->zobrist ^= Zobrist::ep_file[get_file(board.st->en_passant)];
+    new_st->zobrist ^= Zobrist::side_to_move;
+
+    board.st = new_st;
+    board.to_move ^= 1;
+}
+
+void undo_null_move(Board& board, StateStack& ss){
+    board.to_move ^= 1;
+    board.st = board.st->previous;
+    ss.ply--;
+}
+
 // Get the square that a certain color's king is on, assuming only 1 king
 uint8_t king_square(Board& board, uint8_t color) {
     Bitboard kbb = board.bb_pieces[color][KING];
@@ -426,47 +623,103 @@ uint8_t king_square(Board& board, uint8_t color) {
 }
 
 // Check if a square is attacked by a certain color
+// Looks outwards from the target square: a piece of by_color attacks sq exactly when the same piece standing on sq would attack it
 bool square_attacked(Board& board, int sq, uint8_t by_color) {
     Bitboard occ = board.bb_colors[WHITE] | board.bb_colors[BLACK];
-    Bitboard target = 1ULL << sq;
+    const std::array<Bitboard, 6>& pieces = board.bb_pieces[by_color];
 
-    Bitboard pawns = board.bb_pieces[by_color][PAWN];
-    Bitboard pawnAtt = 0ULL;
+    if (PAWN_ATTACKS[!by_color][sq] & pieces[PAWN]) return true;
+    if (KNIGHT_ATTACKS[sq] & pieces[KNIGHT]) return true;
+    if (KING_ATTACKS[sq] & pieces[KING]) return true;
+    if (bishop_move(sq, occ) & (pieces[BISHOP] | pieces[QUEEN])) return true;
+    if (rook_move(sq, occ) & (pieces[ROOK] | pieces[QUEEN])) return true;
 
-    if (by_color == WHITE) {
-        pawnAtt |= (pawns << 7) & ~file_h_bb;
-        pawnAtt |= (pawns << 9) & ~file_a_bb;
-    } else {
-        pawnAtt |= (pawns >> 7) & ~file_a_bb;
-        pawnAtt |= (pawns >> 9) & ~file_h_bb;
-    }
-    if (pawnAtt & target) return true;
+    return false;
+}
 
-    Bitboard knights = board.bb_pieces[by_color][KNIGHT];
-    while (knights) {
-        int from = pop_lsb(knights);
-        if (knight_move(from) & target) return true;
-    }
+// Returns the pieces of both colors that attack a square, given an occupancy (which may differ from the board's own)
+Bitboard attackers_to(Board& board, int sq, Bitboard occ){
+    const std::array<std::array<Bitboard, 6>, 2>& p = board.bb_pieces;
+    return (PAWN_ATTACKS[BLACK][sq] & p[WHITE][PAWN])
+         | (PAWN_ATTACKS[WHITE][sq] & p[BLACK][PAWN])
+         | (KNIGHT_ATTACKS[sq] & (p[WHITE][KNIGHT] | p[BLACK][KNIGHT]))
+         | (KING_ATTACKS[sq] & (p[WHITE][KING] | p[BLACK][KING]))
+         | (bishop_move(sq, occ) & (p[WHITE][BISHOP] | p[BLACK][BISHOP] | p[WHITE][QUEEN] | p[BLACK][QUEEN]))
+         | (rook_move(sq, occ) & (p[WHITE][ROOK] | p[BLACK][ROOK] | p[WHITE][QUEEN] | p[BLACK][QUEEN]));
+}
+
+// Returns the pieces of color that are pinned to their own king by an enemy slider
+// https://www.chessprogramming.org/Pin
+Bitboard pinned_pieces(Board& board, uint8_t color){
+    uint8_t ksq = king_square(board, color);
+    const std::array<Bitboard, 6>& enemy = board.bb_pieces[!color];
+    Bitboard occ = board.bb_colors[WHITE] | board.bb_colors[BLACK];
+    Bitboard snipers = (bishop_move(ksq, 0) & (enemy[BISHOP] | enemy[QUEEN]))
+                     | (rook_move(ksq, 0) & (enemy[ROOK] | enemy[QUEEN]));
+    Bitboard pinned = 0;
+    while(snipers){
+        uint8_t sq = pop_lsb(snipers);
+        Bitboard blockers = between_bb[ksq][sq] & occ;
+        if(blockers && !(blockers & (blockers - 1))) pinned |= blockers & board.bb_colors[color];
+    }
+    return pinned;
+}
+
+// Checks whether an arbitrary move (e.g. a TT move or killer that may come from another position) is legal here, without generating moves
+// First establishes that the move is pseudo-legal for the piece on its from square, then applies the same check and pin rules as generate_legal
+bool is_legal_move(Board& board, Move move){
+    uint8_t us = board.to_move;
+    uint8_t them = !us;
+    uint8_t from = get_from_sq(move);
+    uint8_t to = get_to_sq(move);
+    uint8_t flag = get_move_flags(move);
+    uint8_t pt = piece_on_square(board, us, from);
+    Bitboard to_bb = 1ULL << to;
+    Bitboard occ = board.bb_colors[WHITE] | board.bb_colors[BLACK];
 
-    Bitboard bishops = board.bb_pieces[by_color][BISHOP] | board.bb_pieces[by_color][QUEEN];
-    while (bishops) {
-        int from = pop_lsb(bishops);
-        if (bishop_move(from, occ) & target) return true;
+    if(move == 0 || pt == NONE || (board.bb_colors[us] & to_bb)) return false;
+
+    if(flag == (CASTLE >> 14)){
+        MoveList castles;
+        push_castles(board, us, castles);
+        return castles.contains(move);
     }
 
-    Bitboard rooks = board.bb_pieces[by_color][ROOK] | board.bb_pieces[by_color][QUEEN];
-    while (rooks) {
-        int from = pop_lsb(rooks);
-        if (rook_move(from, occ) & target) return true;
+    uint8_t ksq = king_square(board, us);
+    if(flag == (EN_PASSANT >> 14)){
+        if(pt != PAWN || to != board.st->en_passant || !(PAWN_ATTACKS[us][from] & to_bb)) return false;
+        Bitboard cap_bb = 1ULL << (us == WHITE ? to - 8 : to + 8);
+        Bitboard occ_after = (occ ^ (1ULL << from) ^ cap_bb) | to_bb;
+        return !(attackers_to(board, ksq, occ_after) & board.bb_colors[them] & ~cap_bb);
     }
 
-    Bitboard king = board.bb_pieces[by_color][KING];
-    if (king) {
-        int from = lsb(king);
-        if (king_move(from) & target) return true;
+    // pseudo-legality
+    bool last_rank = to >= A8 || to <= H1;
+    if(pt == PAWN){
+        if(last_rank != (flag == (PROMOTION >> 14))) return false;
+        Bitboard ep_bb = board.st->en_passant < 64 ? (1ULL << board.st->en_passant) : 0ULL;
+        if(!(pawn_move(from, board, us) & ~ep_bb & to_bb)) return false;
+    }
+    else{
+        if(flag != NORMAL) return false;
+        Bitboard attacks = pt == KNIGHT ? knight_move(from)
+                         : pt == BISHOP ? bishop_move(from, occ)
+                         : pt == ROOK   ? rook_move(from, occ)
+                         : pt == QUEEN  ? queen_move(from, occ)
+                         : king_move(from);
+        if(!(attacks & to_bb)) return false;
     }
 
-    return false;
+    // legality
+    if(pt == KING)
+        return !(attackers_to(board, to, occ ^ (1ULL << from)) & board.bb_colors[them]);
+
+    Bitboard checkers = attackers_to(board, ksq, occ) & board.bb_colors[them];
+    if(checkers){
+        if(checkers & (checkers - 1)) return false;
+        if(!((between_bb[ksq][lsb(checkers)] | checkers) & to_bb)) return false;
+    }
+    return !(pinned_pieces(board, us) & (1ULL << from)) || (line_bb[ksq][from] & to_bb);
 }
 
 // Update castling rights after a move. st assumes that the Board's current BoardState has already been updated, so only use after a move is done
@@ -519,10 +772,96 @@ Bitboard check_dst(int square, int offset){
     }
 }
 
-// Checks if a move is a capture
+// Reference bishop attack generator that walks each ray square by square; used to build and verify the magic tables
+Bitboard bishop_move_ref(uint8_t square, Bitboard occupancy){
+    Bitboard b = 0;
+    for(int i : {-9, -7, 7, 9}){
+        uint8_t s = square;
+        while(check_dst(s, i)){
+            b |= (1ULL << (s += i));
+            if(occupancy & (1ULL << s)){
+                break;
+            }
+        }
+    }
+    return b;
+}
+
+// Reference rook attack generator that walks each ray square by square; used to build and verify the magic tables
+Bitboard rook_move_ref(uint8_t square, Bitboard occupancy){
+    Bitboard b = 0;
+    for(int i : {-8, -1, 1, 8}){
+        uint8_t s = square;
+        while(check_dst(s, i)){
+            b |= (1ULL << (s += i));
+            if(occupancy & (1ULL << s)){
+                break;
+            }
+        }
+    }
+    return b;
+}
+
+// Compares the legal move and capture generators against the reference make/unmake filter, returning the number of mismatching lists
+int verify_legal_moves(Board& board, StateStack& ss){
+    int errors = 0;
+    MoveList fast, ref;
+    for(bool captures : {false, true}){
+        if(captures){
+            generate_captures(board, fast);
+            generate_captures_ref(board, ss, ref);
+        }
+        else{
+            generate_moves(board, fast);
+            generate_moves_ref(board, ss, ref);
+        }
+        std::sort(fast.begin(), fast.end());
+        std::sort(ref.begin(), ref.end());
+        if(fast.size() != ref.size() || !std::equal(fast.begin(), fast.end(), ref.begin())) errors++;
+    }
+
+    // captures and quiets must partition the legal moves
+    MoveList quiets;
+    generate_moves_ref(board, ss, ref);
+    generate_captures(board, fast);
+    generate_quiets(board, quiets);
+    if(fast.size() + quiets.size() != ref.size()) errors++;
+
+    // in check, the evasions are all of the legal moves
+    if(square_attacked(board, king_square(board, board.to_move), !board.to_move)){
+        generate_evasions(board, fast);
+        std::sort(fast.begin(), fast.end());
+        std::sort(ref.begin(), ref.end());
+        if(fast.size() != ref.size() || !std::equal(fast.begin(), fast.end(), ref.begin())) errors++;
+    }
+
+    // is_legal_move must accept exactly the legal moves among both sides' pseudo-legal moves
+    for(uint8_t color : {WHITE, BLACK}){
+        MoveList pseudo;
+        generate_pseudo(board, color, pseudo);
+        for(Move m : pseudo)
+            if(is_legal_move(board, m) != ref.contains(m)) errors++;
+    }
+    return errors;
+}
+
+// Compares the magic bitboard attacks of every occupied square against the reference ray walker, returning the number of mismatches
+int verify_slider_attacks(Board& board){
+    Bitboard occ = board.bb_colors[WHITE] | board.bb_colors[BLACK];
+    Bitboard squares = occ;
+    int errors = 0;
+    while(squares){
+        uint8_t sq = pop_lsb(squares);
+        if(bishop_move(sq, occ) != bishop_move_ref(sq, occ)) errors++;
+        if(rook_move(sq, occ) != rook_move_ref(sq, occ)) errors++;
+    }
+    return errors;
+}
+
+// Checks if a move is a capture, including en passant
 bool is_capture(Board& b, Move m){
     uint64_t to_bb = 1ULL << get_to_sq(m);
-    return (b.bb_colors[!b.to_move] & to_bb) != 0;
+    return (b.bb_colors[!b.to_move] & to_bb) != 0 || get_move_flags(m) == (EN_PASSANT >> 14);
 }
 
 // Gets the index of the first non-zero bit
@@ -17,21 +17,93 @@ Bitboard queen_move(uint8_t square, Bitboard occupancy);
 
 Bitboard pawn_move(uint8_t square, Board& board, uint8_t color);
 
+// Reference slider attack generation by ray walking; slow, but used to build and verify the magic bitboard tables
+Bitboard bishop_move_ref(uint8_t square, Bitboard occupancy);
+
+Bitboard rook_move_ref(uint8_t square, Bitboard occupancy);
+
+// Fixed-capacity list of moves stored inline, so move generation never touches the heap
+// scores is a parallel array used by the search for move ordering
+struct MoveList {
+    Move moves[MAX_MOVES];
+    int scores[MAX_MOVES];
+    int count = 0;
+
+    void push(Move m) { moves[count++] = m; }
+    void clear() { count = 0; }
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    Move& operator[](int i) { return moves[i]; }
+    Move* begin() { return moves; }
+    Move* end() { return moves + count; }
+
+    bool contains(Move m) const {
+        for (int i = 0; i < count; i++)
+            if (moves[i] == m) return true;
+        return false;
+    }
+
+    // Sort moves[start..count) by descending score, keeping scores in step (insertion sort; lists are short)
+    void sort(int start = 0) {
+        for (int i = start + 1; i < count; i++) {
+            Move m = moves[i];
+            int s = scores[i];
+            int j = i - 1;
+            for (; j >= start && scores[j] < s; j--) {
+                moves[j + 1] = moves[j];
+                scores[j + 1] = scores[j];
+            }
+            moves[j + 1] = m;
+            scores[j + 1] = s;
+        }
+    }
+};
+
+// Subsets of the legal moves that generate_legal can produce
+enum GenType : uint8_t {
+    GEN_ALL,
+    GEN_CAPTURES,
+    GEN_QUIETS,
+    GEN_EVASIONS
+};
+
 // Move generation
-// Vector of pseudolegal moves
-std::vector<Move> generate_pseudo(Board& board, uint8_t color);
+// All generators fill the supplied MoveList, clearing it first
+// Pseudolegal moves
+void generate_pseudo(Board& board, uint8_t color, MoveList& movelist);
+
+// Legal moves, generated directly from check and pin information
+void generate_moves(Board& board, MoveList& movelist);
+
+// Legal captures (including en passant), generated directly from check and pin information
+void generate_captures(Board& board, MoveList& movelist);
+
+// Legal replies to a check: king moves, captures of the checker and blocks of its ray; only valid while in check
+void generate_evasions(Board& board, MoveList& movelist);
 
-// Vector of legal moves
-std::vector<Move> generate_moves(Board& board, StateStack& ss);
+// Legal non-captures, generated directly from check and pin information
+void generate_quiets(Board& board, MoveList& movelist);
 
-// Vector of legal captures
-std::vector<Move> generate_captures(Board& board, StateStack& ss);
+// Reference legal move generation: pseudo-legal moves filtered by playing each one out with legal()
+// Slow, but kept as a cross-check for generate_moves and generate_captures
+void generate_moves_ref(Board& board, StateStack& ss, MoveList& movelist);
+
+void generate_captures_ref(Board& board, StateStack& ss, MoveList& movelist);
 
 // Make/unmake moves
 void do_move(Board& board, StateStack& ss, Move move);
 
 void undo_move(Board& board, StateStack& ss, Move move);
 
+// Make/unmake a null move (passing the turn)
+void do_null_move(Board& board, StateStack& ss);
+
+void undo_null_move(Board& board, StateStack& ss);
+
+// Zobrist key after a move, computed without playing it; only accurate enough for TT prefetching
+uint64_t key_after(Board& board, Move move);
+
 // Utilities
 // Get the square that a certain color's king is on, assuming only 1 king
 uint8_t king_square(Board& board, uint8_t color);
@@ -39,6 +111,15 @@ uint8_t king_square(Board& board, uint8_t color);
 // Check if a square is attacked by a certain color
 bool square_attacked(Board& board, int sq, uint8_t by_color);
 
+// Returns the pieces of both colors attacking a square under the given occupancy
+Bitboard attackers_to(Board& board, int sq, Bitboard occ);
+
+// Returns the pieces of color pinned to their own king
+Bitboard pinned_pieces(Board& board, uint8_t color);
+
+// Checks whether an arbitrary move (e.g. from the TT or killer table) is legal in the current position
+bool is_legal_move(Board& board, Move move);
+
 // Update castling rights after a move. st assumes that the Board's current BoardState has already been updated, so only use after a move is done
 void update_castling(Board& board, uint8_t color, uint8_t moved_piece, Move move, BoardState& st); // color = color of the moving piece
 
@@ -48,7 +129,13 @@ bool legal(Board& board, StateStack& ss, Move move);
 // Checks if the destination square is a valid destination and returns a bitboard of the destination square
 Bitboard check_dst(int square, int offset);
 
-// Checks if a move is a capture
+// Compares the legal move and capture generators against the reference make/unmake filter, returning the number of mismatching lists
+int verify_legal_moves(Board& board, StateStack& ss);
+
+// Compares magic bitboard slider attacks against the reference ray walker on every occupied square, returning the number of mismatches
+int verify_slider_attacks(Board& board);
+
+// Checks if a move is a capture, including en passant
 bool is_capture(Board& b, Move m);
 
 // Gets the index of the first non-zero bit
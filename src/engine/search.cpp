@@ -1,5 +1,9 @@
 #include <limits>
 #include <algorithm>
+#include <array>
+#include <cmath>
+#include <thread>
+#include <chrono>
 #include "search.h"
 #include "board.h"
 #include "move_gen.h"
@@ -8,134 +12,312 @@
 #include "uci.h"
 #include "time_man.h"
 
-constexpr int MATE = 20000;
-constexpr int MATE_BAND = 1000; // safe range that means mate
 constexpr int ASPIRATION_WINDOW = 30;
-
-bool stop = false;
-
-// Check if score is within mate range and returns a bool 
-inline bool is_mate_score(int s) {
-    return std::abs(s) >= (MATE - MATE_BAND);
-}
-
-// Convert a score at current ply to a ply independent score and returns an int
-inline int score_to_tt(int s, int ply) {
-    if (!is_mate_score(s)) return s;
-    // If s is +mate, make it slightly smaller as ply increases; if -mate, slightly larger
-    return (s > 0) ? (s + ply) : (s - ply);
-}
-
-// Convert a stored TT score back to the current ply’s perspective and returns an int
-inline int score_from_tt(int s, int ply) {
-    if (!is_mate_score(s)) return s;
-    return (s > 0) ? (s - ply) : (s + ply);
-}
+constexpr int ASPIRATION_MAX = 500; // past this window a failing side is opened fully
+constexpr int TM_MIN_DEPTH = 4;     // shallower iterations are too noisy to steer the time limit
+constexpr int NULL_MIN_DEPTH = 3;   // null-move pruning only where the reduced search still has some depth left
+constexpr int NULL_REDUCTION = 3;   // base null-move reduction, plus one ply per 6 plies of depth
+constexpr int NULL_MIN_PHASE = 3;   // game_phase() below this is a bare endgame, where zugzwang is too likely
+constexpr int LMR_MIN_DEPTH = 3;
+constexpr int LMR_MIN_MOVES = 3;    // the first moves are never reduced; they hold the TT move, good captures and killers
+constexpr int LMR_HISTORY_DIV = 8192; // one ply less (or more) reduction per this much history score
+constexpr int CHECK_EXTENSION = 1;  // plies added to the depth of a node in check; 0 turns check extensions off
+
+// Late move reduction in plies by [depth][move number]: 0.75 + ln(depth) * ln(move number) / 2.25
+// https://www.chessprogramming.org/Late_Move_Reductions
+static const auto LMR_TABLE = []{
+    std::array<std::array<int, 64>, 64> t{};
+    for (int d = 1; d < 64; d++)
+        for (int m = 1; m < 64; m++)
+            t[d][m] = int(0.75 + std::log(d) * std::log(m) / 2.25);
+    return t;
+}();
 
 // Initialization of the search DFS stack
+// The root keeps its previous pointer, so the game history before the root stays reachable for repetition detection
 BoardState* init_state_stack(Board& board, StateStack& ss){
     ss.ply = 0;
     ss.states[0] = *board.st;
-    ss.states[0].previous = nullptr;
     return &ss.states[0];
 }
 
+// Checks for a draw by the fifty-move rule or by repetition; ply is the distance from the root
+// Only positions since the last capture or pawn move can repeat, so the zobrist chain is walked back halfmove plies, two at a time
+// A position repeated inside the search tree is scored as a draw at once, since the side that can avoid it would have;
+// one that only repeats a position from before the root needs two earlier occurrences, a real threefold repetition
+// https://www.chessprogramming.org/Repetitions
+static bool is_draw(const Board& b, int ply){
+    if (b.st->halfmove >= 100) return true;
+
+    const BoardState* st = b.st;
+    int repeats = 0;
+    for (int i = 2; i <= b.st->halfmove; i += 2) {
+        if (!st->previous || !st->previous->previous) break;
+        st = st->previous->previous;
+        if (st->zobrist == b.st->zobrist && (i < ply || ++repeats == 2))
+            return true;
+    }
+    return false;
+}
+
 // Debugging function that generates the number of legal nodes up to a certain depth
 // e.g. startpos perft(1) = 20 (white has 20 moves), perft(2) = 400 (black has 20 moves, so 20 * 20 = 400)
+// Move generation is fully legal, so the last ply is bulk counted from the move list size without playing the moves
 // https://www.chessprogramming.org/Perft
-uint64_t perft(Board& b, StateStack& ss, int depth){
+uint64_t perft(Board& b, StateStack& ss, int depth, PerftTable* hash){
+    if(depth <= 0) return 1;
+    uint64_t nodes = 0;
+    if(depth > 1 && hash && hash->probe(b.st->zobrist, depth, nodes)) return nodes;
+
+    MoveList moves;
+    generate_moves(b, moves);
+    if(depth == 1) return moves.size();
+
+    for(Move m : moves){
+        do_move(b, ss, m);
+        nodes += perft(b, ss, depth - 1, hash);
+        undo_move(b, ss, m);
+    }
+    if(hash) hash->store(b.st->zobrist, depth, nodes);
+    return nodes;
+}
+
+// Variation of perft that cross-checks the fast move generation paths against their reference implementations at every node
+// Mismatches are accumulated into errors; the node count must still match plain perft
+uint64_t perft_verify(Board& b, StateStack& ss, int depth, uint64_t& errors){
+    errors += verify_slider_attacks(b);
+    errors += verify_legal_moves(b, ss);
+    errors += verify_eval(b);
+    errors += !board_consistent(b);
     if(depth == 0) return 1;
     uint64_t nodes = 0;
-    std::vector<Move> moves = generate_moves(b, ss);
+    MoveList moves;
+    generate_moves(b, moves);
 
     for(Move m : moves){
         do_move(b, ss, m);
-        nodes += perft(b, ss, depth - 1);
+        nodes += perft_verify(b, ss, depth - 1, errors);
         undo_move(b, ss, m);
     }
     return nodes;
 }
 
 // Variation of perft that lists each move at a certain depth and reports the number of legal nodes for each move
+// With verify set, every node is also cross-checked with perft_verify, and the hash is not used so that every node is visited
+// The root moves are handed out to threads threads in order; each thread plays them on its own copy of the board
 // https://www.chessprogramming.org/Perft#Divide
-uint64_t perft_divide(Board& b, int depth){
-    StateStack ss;
-    BoardState* new_st = init_state_stack(b, ss);
-    StGuard guard(b, new_st);
+uint64_t perft_divide(Board& b, int depth, bool verify, int threads, size_t hash_mb){
+    MoveList moves;
+    generate_moves(b, moves);
+    PerftTable hash;
+    if(!verify) hash.resize_mb(hash_mb);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<uint64_t> counts(moves.size());
+    std::atomic<int> next{0};
+    std::atomic<uint64_t> errors{0};
+    auto worker = [&]() {
+        Board local = b;
+        StateStack ss;
+        StGuard guard(local, init_state_stack(local, ss));
+        uint64_t local_errors = 0;
+        for(int i = next++; i < moves.size(); i = next++){
+            do_move(local, ss, moves[i]);
+            counts[i] = verify ? perft_verify(local, ss, depth - 1, local_errors) : perft(local, ss, depth - 1, &hash);
+            undo_move(local, ss, moves[i]);
+        }
+        errors += local_errors;
+    };
+
+    threads = std::clamp(threads, 1, std::max(1, moves.size()));
+    std::vector<std::thread> helpers;
+    for(int t = 1; t < threads; t++) helpers.emplace_back(worker);
+    worker();
+    for(std::thread& h : helpers) h.join();
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
     uint64_t total = 0;
-    std::vector<Move> moves = generate_moves(b, ss);
-    
     std::cout << "perft_divide at depth " << depth << std::endl;
-    for (Move m : moves) {
-        do_move(b, ss, m);
-        uint64_t nodes = perft(b, ss, depth - 1);
-        undo_move(b, ss, m);
-
-        std::cout << move_to_uci(m) << ": " << nodes << "\n";
-        total += nodes;
+    for(int i = 0; i < moves.size(); i++){
+        std::cout << move_to_uci(moves[i]) << ": " << counts[i] << "\n";
+        total += counts[i];
     }
+    uint64_t nps = (ms > 0) ? (total * 1000ULL) / ms : 0;
 
     std::cout << "\nNodes searched: " << total << "\n";
+    std::cout << "Time: " << ms << " ms, NPS: " << nps << "\n";
+    if (verify) std::cout << "Verification errors: " << errors << "\n";
     return total;
 }
 
-// Starts the iterative deepening search up to a depth of max_depth, and returns the final result
+// Moves until mate for a mate score, negative when we are getting mated; 0 for any other score
+int mate_in(int score) {
+    if (!is_mate_score(score)) return 0;
+    int plies = MATE - std::abs(score);
+    return score > 0 ? (plies + 1) / 2 : -(plies + 1) / 2;
+}
+
+// Formats a score for a UCI info line: "cp <n>", or "mate <moves>" (negative when we are getting mated)
+static std::string uci_score(int score) {
+    if (!is_mate_score(score)) return "cp " + std::to_string(score);
+    return "mate " + std::to_string(mate_in(score));
+}
+
+// Sends one UCI info line for the main thread's current iteration, with nodes totalled over every search thread
+// bound is "", " lowerbound" or " upperbound" for aspiration re-searches
+static void report_iteration(int depth, int multipv, int score, const char* bound, const PVLine& pv, const SearchStats& stats,
+                             const std::vector<std::unique_ptr<SearchThread>>& pool, TranspositionTable& tt, TimeManager& tm){
+    uint64_t nodes = 0;
+    for (const auto& t : pool) nodes += t->stats.nodes.load(std::memory_order_relaxed);
+    int ms = std::max(0, tm.elapsed_ms());
+    uint64_t nps = (ms > 0) ? (nodes * 1000ULL) / ms : 0;
+
+    std::string line = "info depth " + std::to_string(depth)
+        + " seldepth " + std::to_string(stats.seldepth)
+        + " multipv " + std::to_string(multipv)
+        + " score " + uci_score(score) + bound
+        + " nodes " + std::to_string(nodes)
+        + " nps " + std::to_string(nps)
+        + " hashfull " + std::to_string(tt.hashfull())
+        + " time " + std::to_string(ms);
+    if (pv.length > 0) {
+        line += " pv";
+        for (int i = 0; i < pv.length; i++) line += " " + move_to_uci(pv.moves[i]);
+    }
+    uci_send(line);
+}
+
+// Iterative deepening loop run by every search thread, returning the thread's final result
 // Includes aspiration windows to tighten the alpha-beta pruning window
+// Helper threads start on alternating depths so that the threads spread over different parts of the tree sooner
+// With multipv > 1 the main thread searches that many lines per iteration: line k is a root search with the best moves of
+// lines 0..k-1 excluded, each with its own aspiration window; killers, history and the TT carry over between the lines
 // https://www.chessprogramming.org/Iterative_Deepening
 // https://www.chessprogramming.org/Aspiration_Windows
-SearchResult iter_deepening(Board& b, TranspositionTable& tt, SearchStats& stats, TimeManager& tm, int max_depth){
-    tt.new_search();
-    SearchHeuristic sh;
-    SearchResult pv_move; // principal variation
-    pv_move.best_move = 0;
-    pv_move.score_cp = 0;
-    int prev_score = 0; // start centered at 0 cp
+// Only the main thread (id 0) reports info lines, and only when send_info is set; it also feeds the time manager after every iteration
+static SearchResult id_loop(SearchThread& t, TranspositionTable& tt, TimeManager& tm, int max_depth,
+                            const std::vector<std::unique_ptr<SearchThread>>& pool, bool send_info, int multipv){
+    Board& b = t.board;
+    SearchStats& stats = t.stats;
+    bool report = send_info && t.id == 0;
     int base_window = ASPIRATION_WINDOW; // in centipawns
-    stop = false;
     stats.depth = 0;
-
-    for(int depth = 1; depth <= max_depth; depth++){
+    Move last_best_move = 0;
+    int last_score = 0;
+    int stable_iterations = 0; // completed iterations in a row that kept the same best move
+
+    // one result per PV line, each starting centered at 0 cp; line 0 is the full search and the thread's result
+    // helpers only search the first line, which is all they need to feed the TT
+    MoveList root_moves;
+    generate_moves(b, root_moves);
+    int lines = (t.id == 0) ? std::clamp(multipv, 1, std::max(1, root_moves.size())) : 1;
+    std::vector<SearchResult> pv_lines(lines, SearchResult{0, 0, {}});
+
+    for(int depth = 1 + (t.id & 1); depth <= max_depth; depth++){
         if (tm.soft_expired())
             break;
-        if(stop) break;
-        int alpha = -32000;
-        int beta  =  32000;
-        int current_window = base_window;
-
-        if (depth >= 2) {
-            alpha = prev_score - current_window;
-            beta  = prev_score + current_window;
-        }
-
-        while(true){
-            SearchResult r = search_root_window(alpha, beta, b, tt, sh, stats, tm, depth, pv_move.best_move);
-            if(stop) break;
-            // fail-low: score <= alpha, too optimistic
-            if (r.score_cp <= alpha) {
-                current_window *= 2;
-                alpha = -32000;
-                beta  = prev_score + current_window;
-                continue;
+        if(tm.stop) break;
+
+        MoveList excluded; // best moves of the lines already searched at this depth
+        for(int k = 0; k < lines; k++){
+            SearchResult& line = pv_lines[k];
+            int prev_score = line.score_cp;
+            int alpha = -32000;
+            int beta  =  32000;
+            int delta = base_window;
+
+            if (depth >= 2) {
+                alpha = prev_score - delta;
+                beta  = prev_score + delta;
             }
 
-            // fail-high: score >= beta, too pessimistic
-            if (r.score_cp >= beta) {
-                current_window *= 2;
-                beta  = 32000;
-                alpha = prev_score - current_window;
-                continue;
+            // on a failure only the failing side moves, to delta past the returned score, and delta grows by half each time;
+            // once it is past ASPIRATION_MAX that side is opened fully, so a mate score does not take a dozen re-searches
+            while(true){
+                SearchResult r = search_root_window(alpha, beta, b, t.ss, tt, t.sh, stats, tm, depth, line.best_move, &excluded);
+                if(tm.stop){
+                    if (!line.best_move) line.best_move = r.best_move; // stopped in the first iteration: keep the partially searched move
+                    break;
+                }
+                // fail-low: score <= alpha, too optimistic
+                // no root move reached alpha, so the PV of the last completed iteration is reported with the bound
+                // beta comes down to the middle of the old window, as the true score is now known to be below alpha
+                if (r.score_cp <= alpha) {
+                    if (report) report_iteration(depth, k + 1, alpha, " upperbound", line.pv, stats, pool, tt, tm);
+                    beta  = (alpha + beta) / 2;
+                    alpha = (delta > ASPIRATION_MAX) ? -32000 : std::max(r.score_cp - delta, -32000);
+                    delta += delta / 2;
+                    continue;
+                }
+
+                // fail-high: score >= beta, too pessimistic
+                if (r.score_cp >= beta) {
+                    if (report) report_iteration(depth, k + 1, beta, " lowerbound", t.sh.pv.root(), stats, pool, tt, tm);
+                    beta  = (delta > ASPIRATION_MAX) ? 32000 : std::min(r.score_cp + delta, 32000);
+                    delta += delta / 2;
+                    continue;
+                }
+
+                // success
+                line = r;
+                line.pv = t.sh.pv.root();
+                break;
             }
-
-            // success
-            pv_move = r;
-            prev_score = pv_move.score_cp;
-            break;
+            if (tm.stop) break;
+            excluded.push(line.best_move);
+        }
+        if (tm.stop) break;
+
+        // the excluded searches can be slightly unstable, so keep the alternative lines in score order; line 0 stays the full search
+        std::stable_sort(pv_lines.begin() + 1, pv_lines.end(),
+                         [](const SearchResult& x, const SearchResult& y){ return x.score_cp > y.score_cp; });
+        if (report) {
+            for(int k = 0; k < lines; k++)
+                report_iteration(depth, k + 1, pv_lines[k].score_cp, "", pv_lines[k].pv, stats, pool, tt, tm);
         }
         stats.depth++;
-        if (stop) break;
-        if(pv_move.score_cp > 10000) break; // end search early if forced mate
+        if(pv_lines[0].score_cp > 10000) break; // end search early if forced mate
+
+        // the main thread rescales the soft time limit from how settled the best move looks
+        if (t.id == 0) {
+            const SearchResult& best = pv_lines[0];
+            stable_iterations = (best.best_move == last_best_move) ? stable_iterations + 1 : 0;
+            if (depth >= TM_MIN_DEPTH)
+                tm.update_soft_limit(stable_iterations, last_score - best.score_cp,
+                                     best.nodes ? double(best.best_move_nodes) / best.nodes : 1.0);
+            last_best_move = best.best_move;
+            last_score = best.score_cp;
+        }
     }
-    return pv_move;
+    // stopped before the first iteration searched anything: any legal move beats reporting none
+    if (!pv_lines[0].best_move && root_moves.size() > 0) pv_lines[0].best_move = root_moves[0];
+    return pv_lines[0];
+}
+
+// Starts the iterative deepening search up to a depth of max_depth, and returns the final result
+// With threads > 1 this is Lazy SMP: helper threads run the same iterative deepening loop on private copies of the position,
+// communicating only through the shared transposition table; the main thread's result is returned
+// https://www.chessprogramming.org/Lazy_SMP
+SearchResult iter_deepening(Board& b, TranspositionTable& tt, SearchStats& stats, TimeManager& tm, int max_depth, int threads, bool send_info, int multipv){
+    tt.new_search(); // tm.stop is left alone: the caller resets it, and a "stop" that arrives before this point must still end the search
+
+    std::vector<std::unique_ptr<SearchThread>> pool;
+    for(int i = 0; i < std::max(1, threads); i++)
+        pool.push_back(std::make_unique<SearchThread>(b, i));
+
+    std::vector<std::thread> helpers;
+    for(size_t i = 1; i < pool.size(); i++)
+        helpers.emplace_back([&, i]{ id_loop(*pool[i], tt, tm, max_depth, pool, send_info, multipv); });
+
+    SearchResult result = id_loop(*pool[0], tt, tm, max_depth, pool, send_info, multipv);
+
+    tm.stop = true; // the main thread is done, release the helpers
+    for(std::thread& h : helpers) h.join();
+
+    stats = pool[0]->stats;
+    for(size_t i = 1; i < pool.size(); i++)
+        stats.nodes += pool[i]->stats.nodes.load(std::memory_order_relaxed);
+    return result;
 }
 
 // Helper function that starts the root negamax search
@@ -144,12 +326,11 @@ SearchResult iter_deepening(Board& b, TranspositionTable& tt, SearchStats& stats
 // https://www.chessprogramming.org/MVV-LVA
 // https://www.chessprogramming.org/Killer_Move
 // https://www.chessprogramming.org/History_Heuristic
-SearchResult search_root_window(int alpha, int beta, Board& b, TranspositionTable& tt, SearchHeuristic& sh, SearchStats& stats, TimeManager& tm, int depth, Move prev_best){
+SearchResult search_root_window(int alpha, int beta, Board& b, StateStack& ss, TranspositionTable& tt, SearchHeuristic& sh, SearchStats& stats, TimeManager& tm, int depth, Move prev_best, const MoveList* excluded){
     SearchResult result;
     result.best_move = 0;
     result.score_cp = 0;
 
-    StateStack ss;
     BoardState* new_st = init_state_stack(b, ss);
     StGuard guard(b, new_st);
 
@@ -158,81 +339,96 @@ SearchResult search_root_window(int alpha, int beta, Board& b, TranspositionTabl
     int tt_score = 0;
 
      // movegen
-    std::vector<Move> moves = generate_moves(b, ss);
+    MoveList moves;
+    generate_moves(b, moves);
+    bool excluding = excluded && !excluded->empty();
+    if (excluding) {
+        int n = 0;
+        for (int i = 0; i < moves.size(); i++)
+            if (!excluded->contains(moves[i])) moves[n++] = moves[i];
+        moves.count = n;
+    }
+    sh.pv.clear(0);
     if(moves.empty()){
         result.best_move = 0;
         result.score_cp = 0;
         return result;
     }
 
-    // check transposition tables and tighten window accordingly
+    // the TT only supplies a move for ordering here; the root is always searched so that every iteration produces a full PV
     int alpha_probe = alpha, beta_probe = beta;
-    bool tt_hit = tt.probe(key, depth, alpha_probe, beta_probe, tt_score, tt_move);
+    tt.probe(key, depth, 0, alpha_probe, beta_probe, tt_score, tt_move);
     bool tt_legal = false;
     if (tt_move) {
-        tt_legal = std::find(moves.begin(), moves.end(), tt_move) != moves.end();
-    }
-    if (tt_hit && tt_legal) {
-        result.best_move = tt_move;
-        result.score_cp = score_from_tt(tt_score, ss.ply);
-        return result;
+        tt_legal = moves.contains(tt_move);
     }
-    alpha = alpha_probe; beta = beta_probe;
 
     // sort moves in order: pv, tt_move, captures, killer 1, killer 2, all other quiet moves in order on history
     bool pv_legal = false;
-    if (prev_best) {
-        auto it = std::find(moves.begin(), moves.end(), prev_best);
-        if (it != moves.end()) {
-            move_to_index(moves, prev_best, 0);
-            pv_legal = true;
-        }
+    if (prev_best && moves.contains(prev_best)) {
+        move_to_index(moves, prev_best, 0);
+        pv_legal = true;
     }
-    size_t start = pv_legal ? 1 : 0;
+    int start = pv_legal ? 1 : 0;
     if (tt_move && tt_move != prev_best && moves.size() > 1 && tt_legal) {
-        move_to_index(moves, tt_move, 1);
+        move_to_index(moves, tt_move, start);
         start++;
     }
-    if (moves.size() > start) {
-        std::sort(moves.begin() + start, moves.end(), [&](Move amove, Move bmove) {
-                return score_move(b, ss, sh, amove) > score_move(b, ss, sh, bmove);
-            }
-        );
-    }
+    for (int i = start; i < moves.size(); i++)
+        moves.scores[i] = score_move(b, ss, sh, moves[i]);
+    moves.sort(start);
 
-    // main search loop
+    // main search loop; principal variation search, as in alpha_beta_negamax
     int best_score = -64000;
     Move best_move = moves[0];
     int entry_alpha = alpha;
+    int move_count = 0;
+    uint64_t root_nodes = stats.nodes.load(std::memory_order_relaxed);
+    uint64_t best_move_nodes = 0;
     for(Move m : moves) {
-        if(stop) break;
+        if(tm.stop) break;
+        tt.prefetch(key_after(b, m)); // start loading the child's TT bucket while do_move runs; even at depth 1, as a child in check is extended back to depth 1 and probes
+        uint64_t move_start = stats.nodes.load(std::memory_order_relaxed);
         do_move(b, ss, m);
-        int score = -alpha_beta_negamax(-beta, -alpha, b, ss, tt, sh, stats, tm, depth - 1);
+        int score;
+        if (++move_count == 1) {
+            score = -alpha_beta_negamax(-beta, -alpha, b, ss, tt, sh, stats, tm, depth - 1);
+        } else {
+            score = -alpha_beta_negamax(-alpha - 1, -alpha, b, ss, tt, sh, stats, tm, depth - 1);
+            if (score > alpha && score < beta)
+                score = -alpha_beta_negamax(-beta, -alpha, b, ss, tt, sh, stats, tm, depth - 1);
+        }
         undo_move(b, ss, m);
         if(score > best_score){
             best_score = score;
             best_move = m;
+            best_move_nodes = stats.nodes.load(std::memory_order_relaxed) - move_start;
+        }
+        if(score > alpha){
+            alpha = score;
+            sh.pv.update(0, m);
         }
-        if(score > alpha) alpha = score;
         if (score >= beta) {
-            tt.store(key, depth, score_to_tt(score, ss.ply), TT_LOWERBOUND, m);
+            if (!excluding) tt.store(key, depth, score_to_tt(score, ss.ply), TT_LOWERBOUND, m);
             result.best_move = m;
             result.score_cp  = score;
             return result;
         }
-        if(stop) break;
+        if(tm.stop) break;
     }
     TTFlag flag = TT_EXACT;
     if (best_score <= entry_alpha) flag = TT_UPPERBOUND; // fail-low vs entry window
 
-    if (stop) {
+    if (tm.stop) {
         result.best_move = best_move;
         result.score_cp = best_score;
         return result;
     }
-    tt.store(key, depth, score_to_tt(best_score, ss.ply), flag, best_move);
+    if (!excluding) tt.store(key, depth, score_to_tt(best_score, ss.ply), flag, best_move); // with moves excluded this is not the position's true score
     result.best_move = best_move;
     result.score_cp = best_score;
+    result.best_move_nodes = best_move_nodes;
+    result.nodes = stats.nodes.load(std::memory_order_relaxed) - root_nodes;
     return result;
 }
 
@@ -244,14 +440,18 @@ SearchResult search_root_window(int alpha, int beta, Board& b, TranspositionTabl
 // https://www.chessprogramming.org/MVV-LVA
 // https://www.chessprogramming.org/Killer_Move
 // https://www.chessprogramming.org/History_Heuristic
-int alpha_beta_negamax(int alpha, int beta, Board& b, StateStack& ss, TranspositionTable& tt, SearchHeuristic& sh, SearchStats& stats, TimeManager& tm, int depth){
-    if(stop) return (b.to_move == WHITE ? evaluate(b) : -evaluate(b));
-    stats.nodes++;
+// Selectivity comes from null-move pruning, late move reductions and principal variation search
+// https://www.chessprogramming.org/Principal_Variation_Search
+int alpha_beta_negamax(int alpha, int beta, Board& b, StateStack& ss, TranspositionTable& tt, SearchHeuristic& sh, SearchStats& stats, TimeManager& tm, int depth, bool can_null){
+    sh.pv.clear(ss.ply);
+    bool pv_node = beta - alpha > 1; // null-window searches are never on the principal variation
+    if(tm.stop) return (b.to_move == WHITE ? evaluate(b) : -evaluate(b));
+    stats.add_node();
     if (ss.ply > stats.seldepth) stats.seldepth = ss.ply;
 
-    if ((stats.nodes & 2047) == 0) {
+    if ((stats.nodes.load(std::memory_order_relaxed) & 2047) == 0) {
         if (tm.hard_expired()) {
-            stop = true;
+            tm.stop = true;
             return (b.to_move == WHITE ? evaluate(b) : -evaluate(b));
         }
     }
@@ -260,50 +460,88 @@ int alpha_beta_negamax(int alpha, int beta, Board& b, StateStack& ss, Transposit
     Move tt_move = 0;
     int tt_score = 0;
 
-    // check for finish
-    if(depth == 0) return quiesce(alpha, beta, b, ss, stats, tm);
-
-    std::vector<Move> moves = generate_moves(b, ss);
+    uint8_t color = b.to_move;
+    bool in_check = square_attacked(b, king_square(b, color), !color);
 
-    // check/stale mate check
-    if(moves.empty()){
-        uint8_t color = b.to_move;
-        bool in_check = square_attacked(b, king_square(b, color), !color);
-        if(in_check)
-            return -MATE + ss.ply;
-        else
-            return 0;
+    if (is_draw(b, ss.ply)) {
+        // a fifty-move draw is still lost if the move that reached it was checkmate
+        if (b.st->halfmove >= 100 && in_check) {
+            MoveList moves;
+            generate_moves(b, moves);
+            if (moves.empty()) return -MATE + ss.ply;
+        }
+        return 0;
     }
+    if (ss.ply >= MAX_PLY - 1) return (color == WHITE ? evaluate(b) : -evaluate(b));
+
+    // check extension: a check is searched deeper, so forcing sequences are not cut off at the horizon
+    // https://www.chessprogramming.org/Check_Extensions
+    if (in_check) depth += CHECK_EXTENSION;
+
+    // check for finish
+    if(depth <= 0) return quiesce(alpha, beta, b, ss, stats, tm);
 
     // check the transposititon table and tighten window accordingly
+    // probing before any move generation means a cutoff here costs no movegen at all
+    // PV nodes only take the move: a cutoff there would end the PV (and every MultiPV line) at this node
     int alpha_probe = alpha, beta_probe = beta;
-    if (tt.probe(key, depth, alpha_probe, beta_probe, tt_score, tt_move)) {
-        return score_from_tt(tt_score, ss.ply);
+    bool tt_cutoff = tt.probe(key, depth, ss.ply, alpha_probe, beta_probe, tt_score, tt_move);
+    if (!pv_node) {
+        if (tt_cutoff) return tt_score;
+        alpha = alpha_probe;
+        beta = beta_probe;
     }
-    alpha = alpha_probe;
-    beta = beta_probe;
 
-    // sort moves in order: tt_move, captures, killer 1, killer 2, all other quiet moves based on history
-    bool tt_legal = std::find(moves.begin(), moves.end(), tt_move) != moves.end();
-    if (tt_legal) move_to_index(moves, tt_move, 0);
-    size_t start = tt_legal ? 1 : 0;
-    
-    if(moves.size() > start){    
-        std::sort(moves.begin() + start, moves.end(), [&](Move amove, Move bmove) {
-                return score_move(b, ss, sh, amove) > score_move(b, ss, sh, bmove);
-            }
-        );
+    // null-move pruning: if passing the turn still fails high on a reduced search, a real move would too
+    // not done twice in a row, in check, or where zugzwang is likely: without pieces for the side to move or in a bare endgame
+    Bitboard pieces = b.bb_pieces[color][KNIGHT] | b.bb_pieces[color][BISHOP] | b.bb_pieces[color][ROOK] | b.bb_pieces[color][QUEEN];
+    if (can_null && !pv_node && !in_check && depth >= NULL_MIN_DEPTH && pieces && game_phase(b) >= NULL_MIN_PHASE
+        && !is_mate_score(beta) && (color == WHITE ? evaluate(b) : -evaluate(b)) >= beta) {
+        int r = NULL_REDUCTION + depth / 6;
+        do_null_move(b, ss);
+        int score = -alpha_beta_negamax(-beta, -beta + 1, b, ss, tt, sh, stats, tm, std::max(0, depth - 1 - r), false);
+        undo_null_move(b, ss);
+        if (score >= beta) return is_mate_score(score) ? beta : score; // a mate found after passing is not a real mate
     }
 
+    // moves come in order: tt_move, good captures, killer 1, killer 2, all other quiet moves based on history, bad captures
+    MovePicker picker(b, sh, ss.ply, tt_move);
+
     // main search loop
     int best = -64000;
     Move best_move = 0;
     int entry_alpha = alpha;
-    std::vector<Move> quiets_searched;
-    for(Move m : moves){
-        if(stop) break;
+    int move_count = 0;
+    MoveList quiets_searched;
+    Move m;
+    while((m = picker.next())){
+        if(tm.stop) break;
+        move_count++;
+        bool quiet = !is_capture(b, m) && parse_promotion_flag(m) == NONE;
+        tt.prefetch(key_after(b, m)); // start loading the child's TT bucket while do_move runs; even at depth 1, as a child in check is extended back to depth 1 and probes
         do_move(b, ss, m);
-        int score = -alpha_beta_negamax(-beta, -alpha, b, ss, tt, sh, stats, tm, depth - 1); 
+        int score;
+        if (move_count == 1) {
+            score = -alpha_beta_negamax(-beta, -alpha, b, ss, tt, sh, stats, tm, depth - 1);
+        } else {
+            // late move reductions: quiet moves this far down the ordering rarely raise alpha, so they get a shallower null-window search
+            // reduced less on the PV and for moves with a good history, more for a bad history; checks and evasions are not reduced
+            int r = 0;
+            if (depth >= LMR_MIN_DEPTH && move_count > LMR_MIN_MOVES && quiet && !in_check
+                && !square_attacked(b, king_square(b, b.to_move), color)) {
+                r = LMR_TABLE[std::min(depth, 63)][std::min(move_count, 63)];
+                r -= pv_node;
+                r -= sh.history[color][get_from_sq(m)][get_to_sq(m)] / LMR_HISTORY_DIV;
+                r = std::clamp(r, 0, depth - 2);
+            }
+            // PVS: every move after the first is expected to fail low, which a null window proves cheaply;
+            // one that beats alpha is searched again at full depth, then with the full window if it may be a new PV
+            score = -alpha_beta_negamax(-alpha - 1, -alpha, b, ss, tt, sh, stats, tm, depth - 1 - r);
+            if (score > alpha && r > 0)
+                score = -alpha_beta_negamax(-alpha - 1, -alpha, b, ss, tt, sh, stats, tm, depth - 1);
+            if (score > alpha && score < beta)
+                score = -alpha_beta_negamax(-beta, -alpha, b, ss, tt, sh, stats, tm, depth - 1);
+        }
         undo_move(b, ss, m);
         if(score > best){
             best = score;
@@ -326,13 +564,20 @@ int alpha_beta_negamax(int alpha, int beta, Board& b, StateStack& ss, Transposit
         
         // alpha is the lower bound; the best score we can force, so we can ignore anything worse than alpha
         // here we simply update alpha to represent the best score we can get
-        if(score > alpha) alpha = score; 
+        if(score > alpha){
+            alpha = score;
+            sh.pv.update(ss.ply, m);
+        }
 
         // handling history heuristic maluses
         if (!is_capture(b, m))
-            quiets_searched.push_back(m);
+            quiets_searched.push(m);
     }
-    if (stop) return best;
+    if (tm.stop) return best;
+
+    // check/stale mate check
+    if (move_count == 0) return in_check ? (-MATE + ss.ply) : 0;
+
     TTFlag flag = TT_EXACT;
     if (best <= entry_alpha) flag = TT_UPPERBOUND;
     tt.store(key, depth, score_to_tt(best, ss.ply), flag, best_move);
@@ -340,36 +585,38 @@ int alpha_beta_negamax(int alpha, int beta, Board& b, StateStack& ss, Transposit
 }
 
 // Quiescence search, used after the target negamax depth is reached to prevent the horizon effect and only evaluates captures
+// Captures that lose material by SEE are not searched at all; the quiescence MovePicker stops before its bad capture stage
+// In check there is no standing pat: every evasion is searched, and a position without one is mate
 // https://www.chessprogramming.org/Quiescence_Search
 // https://www.chessprogramming.org/MVV-LVA
 // https://www.chessprogramming.org/Delta_Pruning
 int quiesce(int alpha, int beta, Board& b, StateStack& ss, SearchStats& stats, TimeManager& tm){
-    if(stop) return (b.to_move == WHITE ? evaluate(b) : -evaluate(b));
+    if(tm.stop) return (b.to_move == WHITE ? evaluate(b) : -evaluate(b));
     
-    stats.nodes++;
+    stats.add_node();
     if (ss.ply > stats.seldepth) stats.seldepth = ss.ply;
 
-    if ((stats.nodes & 2047) == 0) {
+    if ((stats.nodes.load(std::memory_order_relaxed) & 2047) == 0) {
         if (tm.hard_expired()) {
-            stop = true;
+            tm.stop = true;
             return (b.to_move == WHITE ? evaluate(b) : -evaluate(b));
         }
     }
 
     int static_eval = b.to_move == WHITE ? evaluate(b) : -evaluate(b);
-    int best = static_eval;
+    if (ss.ply >= MAX_PLY - 1) return static_eval;
+
+    bool in_check = square_attacked(b, king_square(b, b.to_move), !b.to_move);
+    int best = in_check ? (-MATE + ss.ply) : static_eval;
     if(best >= beta) return beta;
     if(best > alpha) alpha = best;
 
-    std::vector<Move> captures = generate_captures(b, ss);
-    std::sort(captures.begin(), captures.end(), [&](Move amove, Move bmove) {
-                return mvv_lva_score(b, amove) > mvv_lva_score(b, bmove);
-            }
-        );
-    for(Move m : captures){
-        if(stop) break;
+    MovePicker picker(b, in_check);
+    Move m;
+    while((m = picker.next())){
+        if(tm.stop) break;
         int phase = game_phase(b);
-        if(phase >= 6){
+        if(!in_check && phase >= 6){
             int captured = get_captured_piece(b, m);
             int gain = delta_piece_value(captured, phase);
             int margin = 200;
@@ -384,23 +631,23 @@ int quiesce(int alpha, int beta, Board& b, StateStack& ss, SearchStats& stats, T
         if(score >= beta) return beta;
         if(score > best) best = score;
         if(score > alpha) alpha = score;
-        if (stop) break;
+        if (tm.stop) break;
     }
 
     return best;
 }
 
-// Moves a Move in a vector of Moves to the specified index
-void move_to_index(std::vector<Move>& moves, Move m, size_t idx){
+// Moves a Move in a MoveList to the specified index
+void move_to_index(MoveList& moves, Move m, int idx){
     if(m == 0 || idx >= moves.size()) return;
-    auto it = std::find(moves.begin()+idx, moves.end(), m);
+    Move* it = std::find(moves.begin() + idx, moves.end(), m);
     if(it != moves.end())
-        std::iter_swap(moves.begin()+idx, it);
+        std::iter_swap(moves.begin() + idx, it);
 }
 
 // Returns a "score" for a Move, used for move ordering
 int score_move(Board& b, StateStack& ss, SearchHeuristic& sh, Move m){
-    if(is_capture(b, m)) return ((MAX_HISTORY * 3) + mvv_lva_score(b, m));
+    if(is_capture(b, m)) return (see(b, m, 0) ? (MAX_HISTORY * 3) : -(MAX_HISTORY * 2)) + mvv_lva_score(b, m);
 
     if (ss.ply >= 0 && ss.ply < MAX_PLY) {
         if (m == sh.killers[ss.ply][0]) return (MAX_HISTORY * 2);
@@ -408,10 +655,163 @@ int score_move(Board& b, StateStack& ss, SearchHeuristic& sh, Move m){
     }
 
     return sh.history[b.to_move][get_from_sq(m)][get_to_sq(m)]; // clamped to MAX_HISTORY
-    // score order should be: PV move, TT move, captures, killer 1, killer 2, all other quiet moves in order of history score
+    // score order should be: PV move, TT move, good captures, killer 1, killer 2, all other quiet moves in order of history score, bad captures
     // PV and TT moves will be handled during search
 }
 
+// Static exchange evaluation: true if the exchange sequence started by m on its target square wins at least threshold
+// Both sides recapture with their least valuable attacker and may stop whenever continuing would lose material;
+// sliders behind a capturing piece join in as it leaves (x-rays). Pins are ignored, and a king only recaptures onto an undefended square
+// https://www.chessprogramming.org/Static_Exchange_Evaluation
+bool see(Board& b, Move m, int threshold) {
+    if (get_move_flags(m) == (CASTLE >> 14)) return threshold <= 0;
+
+    int from = get_from_sq(m);
+    int to = get_to_sq(m);
+    int victim = get_captured_piece(b, m);
+
+    // swap is the margin the side to move still needs: first whether the capture alone reaches threshold,
+    // then whether losing the capturing piece in return still leaves it there
+    int swap = (victim == NONE ? 0 : SEE_PIECE_VALUE[victim]) - threshold;
+    if (swap < 0) return false;
+    swap = SEE_PIECE_VALUE[piece_on_square(b, b.to_move, from)] - swap;
+    if (swap <= 0) return true;
+
+    Bitboard occ = (b.bb_colors[WHITE] | b.bb_colors[BLACK]) ^ (1ULL << from) ^ (1ULL << to);
+    if (get_move_flags(m) == (EN_PASSANT >> 14))
+        occ ^= 1ULL << (b.to_move == WHITE ? to - 8 : to + 8);
+    Bitboard attackers = attackers_to(b, to, occ);
+    Bitboard diagonal = b.bb_pieces[WHITE][BISHOP] | b.bb_pieces[BLACK][BISHOP] | b.bb_pieces[WHITE][QUEEN] | b.bb_pieces[BLACK][QUEEN];
+    Bitboard straight = b.bb_pieces[WHITE][ROOK] | b.bb_pieces[BLACK][ROOK] | b.bb_pieces[WHITE][QUEEN] | b.bb_pieces[BLACK][QUEEN];
+
+    uint8_t stm = b.to_move;
+    bool res = true; // whether the side that made the last capture comes out ahead
+    while (true) {
+        stm ^= 1;
+        attackers &= occ;
+        Bitboard stm_attackers = attackers & b.bb_colors[stm];
+        if (!stm_attackers) break;
+        res = !res;
+
+        int piece = PAWN;
+        while (!(stm_attackers & b.bb_pieces[stm][piece])) piece++;
+        if (piece == KING) // the king may only take if nothing can take it back
+            return (attackers & b.bb_colors[!stm]) ? !res : res;
+
+        // the recapture only pays if the piece it puts on the square may then be lost
+        swap = SEE_PIECE_VALUE[piece] - swap;
+        if (swap < res) break;
+
+        Bitboard lsb = stm_attackers & b.bb_pieces[stm][piece];
+        occ ^= lsb & -lsb;
+        if (piece == PAWN || piece == BISHOP || piece == QUEEN) attackers |= bishop_move(to, occ) & diagonal;
+        if (piece == ROOK || piece == QUEEN) attackers |= rook_move(to, occ) & straight;
+    }
+    return res;
+}
+
+// Picks the highest scoring move in moves[idx..count), swaps it into idx and returns it
+static Move pick_best(MoveList& moves, int idx) {
+    int best = idx;
+    for (int i = idx + 1; i < moves.size(); i++)
+        if (moves.scores[i] > moves.scores[best]) best = i;
+    std::swap(moves.moves[idx], moves.moves[best]);
+    std::swap(moves.scores[idx], moves.scores[best]);
+    return moves[idx];
+}
+
+MovePicker::MovePicker(Board& b_, SearchHeuristic& sh_, int ply, Move tt_move_)
+    : b(b_), sh(&sh_), tt_move(tt_move_), stage(STAGE_TT_MOVE)
+{
+    bool valid_ply = ply >= 0 && ply < MAX_PLY;
+    killers[0] = valid_ply ? sh_.killers[ply][0] : 0;
+    killers[1] = valid_ply ? sh_.killers[ply][1] : 0;
+}
+
+MovePicker::MovePicker(Board& b_, bool in_check)
+    : b(b_), sh(nullptr), tt_move(0), killers{0, 0}, stage(in_check ? STAGE_INIT_EVASIONS : STAGE_INIT_CAPTURES) {}
+
+// Returns the next move to search, generating and scoring each stage only when it is reached, or 0 when exhausted
+Move MovePicker::next() {
+    while (true) {
+        switch (stage) {
+        case STAGE_TT_MOVE:
+            stage++;
+            if (tt_move && is_legal_move(b, tt_move)) return tt_move;
+            break;
+
+        case STAGE_INIT_CAPTURES:
+            generate_captures(b, captures);
+            for (int i = 0; i < captures.size(); i++)
+                captures.scores[i] = mvv_lva_score(b, captures[i]);
+            cur = bad_end = 0;
+            stage++;
+            break;
+
+        case STAGE_GOOD_CAPTURES:
+            while (cur < captures.size()) {
+                Move m = pick_best(captures, cur++);
+                if (m == tt_move) continue;
+                if (!see(b, m, 0)) {
+                    captures[bad_end++] = m; // bad_end < cur, so this slot has already been picked
+                    continue;
+                }
+                return m;
+            }
+            stage = sh ? STAGE_KILLER_1 : STAGE_DONE; // quiescence never searches losing captures
+            cur = 0;
+            break;
+
+        case STAGE_KILLER_1:
+        case STAGE_KILLER_2: {
+            Move k = killers[stage - STAGE_KILLER_1];
+            stage++;
+            if (k && k != tt_move && !is_capture(b, k) && is_legal_move(b, k)) return k;
+            break;
+        }
+
+        case STAGE_INIT_QUIETS:
+            generate_quiets(b, quiets);
+            for (int i = 0; i < quiets.size(); i++)
+                quiets.scores[i] = sh->history[b.to_move][get_from_sq(quiets[i])][get_to_sq(quiets[i])];
+            cur = 0;
+            stage++;
+            break;
+
+        case STAGE_QUIETS:
+            while (cur < quiets.size()) {
+                Move m = pick_best(quiets, cur++);
+                if (m == tt_move || m == killers[0] || m == killers[1]) continue;
+                return m;
+            }
+            cur = 0;
+            stage++;
+            break;
+
+        case STAGE_BAD_CAPTURES:
+            if (cur < bad_end) return captures[cur++];
+            stage = STAGE_DONE;
+            break;
+
+        case STAGE_INIT_EVASIONS:
+            generate_evasions(b, captures);
+            for (int i = 0; i < captures.size(); i++)
+                captures.scores[i] = is_capture(b, captures[i]) ? mvv_lva_score(b, captures[i]) : 0;
+            cur = 0;
+            stage++;
+            break;
+
+        case STAGE_EVASIONS:
+            if (cur < captures.size()) return pick_best(captures, cur++);
+            stage = STAGE_DONE;
+            break;
+
+        default:
+            return 0;
+        }
+    }
+}
+
 // MVV-LVA (Most Valuable Victim - Least Valuable Attacker) prioritizes captures that involve valuable victims, 
 // then prioritzes captures that involve cheap attackers, putting likely good captures earlier
 // https://www.chessprogramming.org/MVV-LVA
@@ -2,13 +2,21 @@
 
 #include <algorithm>
 #include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <limits>
+#include <new>
+#include <string>
+#include <thread>
 
 #include "board.h"
 #include "move_gen.h"
 #include "constants.h"
 #include "time_man.h"
+#include "alloc.h"
 
-extern bool stop;
+// Writes one line to stdout for the GUI; defined in uci.cpp, declared here so the tables can report allocation failures
+void uci_send(const std::string& line);
 
 static constexpr int MVV_LVA_PIECE_VALUE[6] = {
     100, // pawn
@@ -19,17 +27,93 @@ static constexpr int MVV_LVA_PIECE_VALUE[6] = {
     0    // king
 }; // these values don't need to match our PSTs
 
+// Piece values for static exchange evaluation; the king is never actually exchanged, see() handles it separately
+static constexpr int SEE_PIECE_VALUE[6] = {100, 320, 330, 500, 900, 0};
+
+static constexpr int MATE = 20000;
+static constexpr int MATE_BAND = 1000; // safe range that means mate
+
+// Check if score is within mate range and returns a bool
+inline bool is_mate_score(int s) {
+    return std::abs(s) >= (MATE - MATE_BAND);
+}
+
+// Convert a score at current ply to a ply independent score and returns an int
+inline int score_to_tt(int s, int ply) {
+    if (!is_mate_score(s)) return s;
+    // If s is +mate, make it slightly smaller as ply increases; if -mate, slightly larger
+    return (s > 0) ? (s + ply) : (s - ply);
+}
+
+// Convert a stored TT score back to the current ply’s perspective and returns an int
+inline int score_from_tt(int s, int ply) {
+    if (!is_mate_score(s)) return s;
+    return (s > 0) ? (s - ply) : (s + ply);
+}
+
+static constexpr int MAX_PV = 128; // longest principal variation kept; deeper plies are still searched, just not reported
+
+// Principal variation, root move first
+struct PVLine {
+    Move moves[MAX_PV]{};
+    int length = 0;
+};
+
 // Return value of iter_deepning() that contains info about the best move
 struct SearchResult {
     Move best_move;
     int score_cp; // score in centipawns, perspective = side to move (negamax)
+    PVLine pv; // best line of the last completed iteration
+    uint64_t best_move_nodes = 0; // nodes spent below the best move in this thread's last root search
+    uint64_t nodes = 0; // nodes of that whole root search
 };
 
 // Stat tracker used to print search related info
 struct SearchStats {
-    int nodes = 0; // number of nodes searched
+    std::atomic<uint64_t> nodes{0}; // number of nodes searched; atomic so the main thread can total every thread's count for info lines
     int depth = 0; // depth reached in main negamax search
     int seldepth = 0; // actual deepest branch (including qsearch)
+
+    SearchStats() = default;
+    SearchStats(const SearchStats& o) { *this = o; }
+    SearchStats& operator=(const SearchStats& o) {
+        nodes.store(o.nodes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        depth = o.depth;
+        seldepth = o.seldepth;
+        return *this;
+    }
+
+    // Only the owning thread writes its count, so a relaxed load and store is enough and avoids a locked add on every node
+    void add_node() { nodes.store(nodes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+};
+
+// Triangular PV table; line[ply] holds the best line found from ply onwards in the current branch
+// Built by the search itself rather than walked out of the TT, so it cannot pick up moves from colliding or overwritten entries
+// https://www.chessprogramming.org/Triangular_PV-Table
+struct PVTable {
+    Move line[MAX_PV][MAX_PV]{};
+    int length[MAX_PV]{};
+
+    // Empties the line from ply; called on entering a node
+    void clear(int ply) {
+        if (ply < MAX_PV) length[ply] = ply;
+    }
+
+    // m is the new best move at ply, so the line from ply becomes m followed by the child's line
+    void update(int ply, Move m) {
+        if (ply >= MAX_PV) return;
+        line[ply][ply] = m;
+        int end = (ply + 1 < MAX_PV) ? length[ply + 1] : ply + 1;
+        for (int i = ply + 1; i < end; i++) line[ply][i] = line[ply + 1][i];
+        length[ply] = std::max(end, ply + 1);
+    }
+
+    PVLine root() const {
+        PVLine pv;
+        pv.length = length[0];
+        std::copy(line[0], line[0] + length[0], pv.moves);
+        return pv;
+    }
 };
 
 // Killer move & history heuristic structures
@@ -38,6 +122,7 @@ struct SearchStats {
 struct SearchHeuristic {
     Move killers[MAX_PLY][2]{};
     int history[2][64][64]{}; // [color][from][to]
+    PVTable pv; // per-thread like the killers, since it is also indexed by ply
 
     void clear(){
         for (int ply = 0; ply < MAX_PLY; ++ply) {
@@ -66,62 +151,201 @@ struct SearchHeuristic {
     }
 };
 
+// Stages of the MovePicker, in the order they are visited
+enum PickerStage : uint8_t {
+    STAGE_TT_MOVE,
+    STAGE_INIT_CAPTURES,
+    STAGE_GOOD_CAPTURES,
+    STAGE_KILLER_1,
+    STAGE_KILLER_2,
+    STAGE_INIT_QUIETS,
+    STAGE_QUIETS,
+    STAGE_BAD_CAPTURES,
+    STAGE_INIT_EVASIONS,
+    STAGE_EVASIONS,
+    STAGE_DONE
+};
+
+// Lazy, staged move picker; yields the TT move without any generation, then good captures by MVV-LVA, killers,
+// quiets by history and finally bad captures, those that lose material by SEE. Each stage is only generated when the previous one runs out,
+// so a beta cutoff on an early move skips the rest of the work. Each move is scored once and then selection-picked.
+// Returns 0 when no moves remain; quiescence pickers (no SearchHeuristic) only yield good captures,
+// or every evasion, captures first, when in check.
+// https://www.chessprogramming.org/Move_Ordering#Staged_Move_Generation
+struct MovePicker {
+    Board& b;
+    SearchHeuristic* sh;
+    Move tt_move;
+    Move killers[2];
+    uint8_t stage;
+    MoveList captures; // bad captures are moved to the front of this list as they are found
+    MoveList quiets;
+    int cur = 0;
+    int bad_end = 0;
+
+    // Main search picker
+    MovePicker(Board& b_, SearchHeuristic& sh_, int ply, Move tt_move_);
+
+    // Quiescence picker; good captures only, or all evasions if in_check
+    MovePicker(Board& b_, bool in_check);
+
+    Move next();
+};
+
+// Unpacked contents of a transposition table entry
+struct TTData {
+    Move move = 0;
+    int16_t score = 0;
+    int8_t depth = -1;   // searched depth
+    uint8_t flag = TT_EMPTY;
+    uint8_t age = 0;
+
+    // Pack into a single 64-bit word: move | score << 16 | depth << 32 | flag << 40 | age << 48
+    uint64_t pack() const {
+        return uint64_t(move) | (uint64_t(uint16_t(score)) << 16) | (uint64_t(uint8_t(depth)) << 32)
+             | (uint64_t(flag) << 40) | (uint64_t(age) << 48);
+    }
+
+    static TTData unpack(uint64_t d) {
+        TTData t;
+        t.move  = Move(d);
+        t.score = int16_t(uint16_t(d >> 16));
+        t.depth = int8_t(uint8_t(d >> 32));
+        t.flag  = uint8_t(d >> 40);
+        t.age   = uint8_t(d >> 48);
+        return t;
+    }
+};
+
 // Structure containing data for a single transposition table entry
+// Stored as two 64-bit words, the packed data and the full Zobrist key XORed with it, so that search threads can share the table without locks:
+// a torn entry (words from two different stores) fails the key check on probe and is simply treated as a miss
+// https://www.chessprogramming.org/Shared_Hash_Table#Lock-less
 struct TTEntry {
-    uint16_t key16 = 0;    // 16-bit verification
-    int16_t  score = 0;    
-    int8_t   depth = -1;   // searched depth
-    uint8_t  flag = TT_EMPTY;
-    Move move = 0;
-    uint8_t  age = 0;
+    std::atomic<uint64_t> key_xor{0};
+    std::atomic<uint64_t> data{0};
+
+    // Returns true and fills out if this entry holds key
+    bool read(uint64_t key, TTData& out) const {
+        uint64_t d = data.load(std::memory_order_relaxed);
+        if ((key_xor.load(std::memory_order_relaxed) ^ d) != key) return false;
+        out = TTData::unpack(d);
+        return out.flag != TT_EMPTY;
+    }
+
+    void write(uint64_t key, const TTData& t) {
+        uint64_t d = t.pack();
+        data.store(d, std::memory_order_relaxed);
+        key_xor.store(key ^ d, std::memory_order_relaxed);
+    }
 };
 
+// A cache line of TTEntries; a position may be stored in any entry of the bucket its key maps to,
+// so a probe touches exactly one cache line and a collision no longer has to evict the only entry for an index
+struct alignas(64) TTBucket {
+    static constexpr int SIZE = 4;
+    TTEntry entries[SIZE];
+};
+
+static_assert(sizeof(TTBucket) == 64, "TTBucket must fill exactly one cache line");
+
 // Transposition table; holds previously searched positions to avoid repeatedly searching the same posiions
+// Shared by all search threads
 // https://www.chessprogramming.org/Transposition_Table
 struct TranspositionTable {
-    std::vector<TTEntry> table;
+    TTBucket* table = nullptr; // from large_alloc, so huge-page backed where available
+    size_t size = 0; // number of buckets
     size_t mask = 0; 
     uint8_t age = 0;
 
-    static uint16_t key16(uint64_t key) { return uint16_t(key >> 48); } // Grab the first 16 bits from a hash to use as verification
+    TranspositionTable() = default;
+    TranspositionTable(const TranspositionTable&) = delete;
+    TranspositionTable& operator=(const TranspositionTable&) = delete;
+    ~TranspositionTable() { large_free(table); }
 
-    // Resize table to a specified MB and round down to the closest power of 2^N
-    // This allows us to use a mask of N-1 as the key of the transposition table and avoid storing the entire 64-bit Zobrist hash
-    void resize_mb(size_t megabytes) {
+    // Resize table to a specified MB and round down to the closest power of 2^N buckets
+    // This allows us to use a mask of N-1 as the bucket index
+    // The new table is zeroed by threads threads; see clear()
+    void resize_mb(size_t megabytes, int threads = 1) {
         const size_t bytes = megabytes * 1024ull * 1024ull;
-        size_t entries = bytes / sizeof(TTEntry);
-        if (entries < 2) entries = 2;
+        size_t buckets = bytes / sizeof(TTBucket);
+        if (buckets < 2) buckets = 2;
 
-        // largest power-of-two <= entries
+        // largest power-of-two <= buckets
         size_t n = 1;
-        while ((n << 1) <= entries) n <<= 1;
-
-        table.clear();
-        table.resize(n);
+        while ((n << 1) <= buckets) n <<= 1;
+
+        large_free(table);
+        table = static_cast<TTBucket*>(large_alloc(n * sizeof(TTBucket)));
+        if (!table) {
+            size = mask = 0;
+            uci_send("info string failed to allocate " + std::to_string(megabytes) + " MB transposition table");
+            return;
+        }
+        size = n;
         mask = n - 1;
-        age = 0;
+        clear(threads);
     }
 
     // Used to track the age of TTEntries
     void new_search() { ++age; } // Call at the start of each new root search
 
-    // Fill table with empty entries
-    void clear() { 
-        std::fill(table.begin(), table.end(), TTEntry{});
+    // Fill table with empty entries, splitting the work across threads
+    // Each thread first-touches its own slice, which also spreads the pages across NUMA nodes on multi-socket machines
+    void clear(int threads = 1) {
+        threads = std::max(1, threads);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([this, t, threads] {
+                size_t begin = size * t / threads;
+                size_t end = size * (t + 1) / threads;
+                for (size_t i = begin; i < end; i++) new (&table[i]) TTBucket();
+            });
+        }
+        for (std::thread& w : workers) w.join();
         age = 0;
     }
 
+    // Permille of the table used by the current search, sampled from the first 1000 entries as UCI "hashfull" expects
+    int hashfull() const {
+        if (size == 0) return 0;
+        int used = 0, sampled = 0;
+        for (size_t i = 0; i < size && sampled < 1000; i++) {
+            for (const TTEntry& e : table[i].entries) {
+                TTData t = TTData::unpack(e.data.load(std::memory_order_relaxed));
+                used += (t.flag != TT_EMPTY && t.age == age);
+                sampled++;
+            }
+        }
+        return used * 1000 / sampled;
+    }
+
+    // Bucket that a key maps to
+    TTBucket& bucket(uint64_t key) { return table[key & mask]; }
+
+    // Hint the CPU to start loading a key's bucket into cache ahead of the probe, hiding the memory latency
+    void prefetch(uint64_t key) const {
+        if (table) __builtin_prefetch(&table[key & mask]);
+    }
+
     // Probe the TT for a particular Zobrist hash, updating alpha and beta and the corresponding move/eval, returning a bool indicating success/failure
-    bool probe(uint64_t key, int depth, int& alpha, int& beta, int& out_score, Move& out_move) {
-        if (table.empty()) return false;
-        TTEntry& entry = table[key & mask];
-        if (entry.flag == TT_EMPTY) return false;
-        if (entry.key16 != TranspositionTable::key16(key)) return false;
+    // ply is the distance from the root; out_score and the tightened window are already relative to it
+    bool probe(uint64_t key, int depth, int ply, int& alpha, int& beta, int& out_score, Move& out_move) {
+        if (size == 0) return false;
+        TTData entry;
+        bool found = false;
+        for (TTEntry& e : bucket(key).entries) {
+            if (e.read(key, entry)) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) return false;
 
         out_move = entry.move;
         
         if(entry.depth >= depth){
-            int s = entry.score;
+            int s = score_from_tt(entry.score, ply); // compared with the window at this ply, so mate scores must be converted first
             if (entry.flag == TT_EXACT){ 
                 out_score = s; 
                 return true; 
@@ -146,27 +370,112 @@ struct TranspositionTable {
     }
 
     // Store an entry
-    // Replacement policy: replace if empty, different key, older age, or shallower depth.
+    // If the position is already in its bucket, that entry is overwritten unless it holds a deeper result from this search
+    // (its move is kept when the new store has none). Otherwise the least valuable entry in the bucket is replaced,
+    // where each search of age counts as much as 8 plies of depth, so stale deep entries eventually give way.
     void store(uint64_t key, int depth, int score, TTFlag flag, Move bestMove) {
-        if(table.empty()) return;
-        TTEntry& e = table[key & mask];
-        const uint16_t k16 = key16(key);
-
-        const bool same = (e.flag != TT_EMPTY && e.key16 == k16);
-        const bool replace =
-            (e.flag == TT_EMPTY) ||
-            (!same) ||
-            (e.age != age) ||
-            (depth >= e.depth);
-
-        if (!replace) return;
-
-        e.key16  = k16;
-        e.depth  = (int8_t)std::clamp(depth, -128, 127);
-        e.score  = (int16_t)std::clamp(score, -32000, 32000);
-        e.flag   = (uint8_t)flag;
-        e.move   = bestMove;
-        e.age    = age;
+        if (size == 0) return;
+        TTBucket& bkt = bucket(key);
+        TTEntry* replace = nullptr;
+        TTData old;
+        int worst = std::numeric_limits<int>::max();
+
+        for (TTEntry& e : bkt.entries) {
+            if (e.read(key, old)) {
+                if (old.age == age && depth < old.depth && flag != TT_EXACT) return;
+                if (bestMove == 0) bestMove = old.move;
+                replace = &e;
+                break;
+            }
+            TTData other = TTData::unpack(e.data.load(std::memory_order_relaxed));
+            int value = other.flag == TT_EMPTY ? std::numeric_limits<int>::min()
+                      : other.depth - 8 * uint8_t(age - other.age);
+            if (value < worst) {
+                worst = value;
+                replace = &e;
+            }
+        }
+
+        TTData t;
+        t.depth  = (int8_t)std::clamp(depth, -128, 127);
+        t.score  = (int16_t)std::clamp(score, -32000, 32000);
+        t.flag   = (uint8_t)flag;
+        t.move   = bestMove;
+        t.age    = age;
+        replace->write(key, t);
+    }
+};
+
+// Per-thread search state; with Lazy SMP every thread searches the same root with its own copy of everything except the TT
+// https://www.chessprogramming.org/Lazy_SMP
+struct SearchThread {
+    int id = 0; // 0 is the main thread
+    Board board;
+    StateStack ss;
+    SearchHeuristic sh;
+    SearchStats stats;
+
+    // Takes a private copy of the root position
+    SearchThread(const Board& b, int id_) : id(id_), board(b) {
+        board.root = *b.st;
+        board.st = &board.root;
+    }
+};
+
+// Perft hash entry; as in TTEntry the key is stored XORed with the data, so a torn write from another thread fails the key check
+struct PerftEntry {
+    std::atomic<uint64_t> key_xor{0};
+    std::atomic<uint64_t> data{0}; // leaf count << 8 | depth
+};
+
+// Hash table of (position, depth) -> leaf count, so perft counts each transposition only once
+// Lock-free and shared by all perft threads; always-replace, since every entry is exact
+// https://www.chessprogramming.org/Perft#Hashing
+struct PerftTable {
+    PerftEntry* table = nullptr;
+    size_t size = 0;
+    size_t mask = 0;
+
+    PerftTable() = default;
+    PerftTable(const PerftTable&) = delete;
+    PerftTable& operator=(const PerftTable&) = delete;
+    ~PerftTable() { large_free(table); }
+
+    // Resize table to a specified MB, rounded down to a power of 2 entries; 0 MB disables the table
+    void resize_mb(size_t megabytes) {
+        large_free(table);
+        table = nullptr;
+        size = mask = 0;
+        size_t entries = megabytes * 1024ull * 1024ull / sizeof(PerftEntry);
+        if (entries < 2) return;
+
+        size_t n = 1;
+        while ((n << 1) <= entries) n <<= 1;
+        table = static_cast<PerftEntry*>(large_alloc(n * sizeof(PerftEntry)));
+        if (!table) {
+            uci_send("info string failed to allocate " + std::to_string(megabytes) + " MB perft hash");
+            return;
+        }
+        for (size_t i = 0; i < n; i++) new (&table[i]) PerftEntry();
+        size = n;
+        mask = n - 1;
+    }
+
+    bool probe(uint64_t key, int depth, uint64_t& nodes) const {
+        if (size == 0) return false;
+        const PerftEntry& e = table[key & mask];
+        uint64_t d = e.data.load(std::memory_order_relaxed);
+        if ((e.key_xor.load(std::memory_order_relaxed) ^ d) != key || int(d & 0xFF) != depth) return false;
+        nodes = d >> 8;
+        return true;
+    }
+
+    void store(uint64_t key, int depth, uint64_t nodes) {
+        if (size == 0) return;
+        PerftEntry& e = table[key & mask];
+        uint64_t d = (nodes << 8) | uint64_t(depth);
+        e.data.store(d, std::memory_order_relaxed);
+        e.key_xor.store(key ^ d, std::memory_order_relaxed);
     }
 };
 
@@ -174,27 +483,41 @@ struct TranspositionTable {
 BoardState* init_state_stack(Board& board, StateStack& ss);
 
 // Perft debugging functions, prints number of leaf nodes at a certain depth
-uint64_t perft(Board& b, StateStack& ss, int depth);
+// hash may be null to search without a perft hash table
+uint64_t perft(Board& b, StateStack& ss, int depth, PerftTable* hash = nullptr);
+
+uint64_t perft_verify(Board& b, StateStack& ss, int depth, uint64_t& errors);
 
-uint64_t perft_divide(Board& b, int depth);
+// Root moves are split over threads threads; hash_mb > 0 enables a shared perft hash of that size
+uint64_t perft_divide(Board& b, int depth, bool verify = false, int threads = 1, size_t hash_mb = 0);
 
-// Main iterative deepening function
-SearchResult iter_deepening(Board& b, TranspositionTable& tt, SearchStats& stats, TimeManager& tm, int max_depth);
+// Main iterative deepening function; runs threads - 1 Lazy SMP helper threads alongside the calling thread
+// stats receives the main thread's depth info and the node count summed over all threads
+// With send_info set, a UCI info line with the PV is sent after every iteration and aspiration re-search
+// multipv is the number of best lines searched and reported; the returned result is always the best line
+SearchResult iter_deepening(Board& b, TranspositionTable& tt, SearchStats& stats, TimeManager& tm, int max_depth, int threads = 1, bool send_info = false, int multipv = 1);
 
-// Main search function, returns the best move
-SearchResult search_root_window(int alpha, int beta, Board& b, TranspositionTable& tt, SearchHeuristic& sh, SearchStats& stats, TimeManager& tm, int depth, Move prev_best = 0);
+// Main search function, returns the best move; root moves in excluded are skipped, for MultiPV
+SearchResult search_root_window(int alpha, int beta, Board& b, StateStack& ss, TranspositionTable& tt, SearchHeuristic& sh, SearchStats& stats, TimeManager& tm, int depth, Move prev_best = 0, const MoveList* excluded = nullptr);
 
 // Negamax search through the entire search tree up to depth; implement alpha-beta pruning
-int alpha_beta_negamax(int alpha, int beta, Board& b, StateStack& ss, TranspositionTable& tt, SearchHeuristic& sh, SearchStats& stats, TimeManager& tm, int depth);
+// can_null is false right after a null move, so that two null moves are never played in a row
+int alpha_beta_negamax(int alpha, int beta, Board& b, StateStack& ss, TranspositionTable& tt, SearchHeuristic& sh, SearchStats& stats, TimeManager& tm, int depth, bool can_null = true);
 
 // Quiescence search to continue searching through captures, alleviating horizon effect
 int quiesce(int alpha, int beta, Board& b, StateStack& ss, SearchStats& stats, TimeManager& tm);
 
-// Puts a move to the front of a vector of Moves, enabling better move ordering
-void move_to_index(std::vector<Move>& moves, Move m, size_t idx);
+// Moves until mate for a mate score, negative when we are getting mated; 0 for any other score
+int mate_in(int score);
+
+// Puts a move to the front of a MoveList, enabling better move ordering
+void move_to_index(MoveList& moves, Move m, int idx);
 
 // Gives a move a score used for move ordering
 int score_move(Board& b, StateStack& ss, SearchHeuristic& sh, Move m);
 
 // MVV-LVA implementation to order more valuable captures first
 int mvv_lva_score(Board& b, Move m);
+
+// Static exchange evaluation; true if playing m wins at least threshold centipawns once all exchanges on its square are resolved
+bool see(Board& b, Move m, int threshold = 0);
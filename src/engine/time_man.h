@@ -1,41 +1,80 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <stdio.h>
 
+static constexpr int MOVE_OVERHEAD_MS = 30;    // kept back on every move for GUI and pipe latency
+static constexpr int DEFAULT_MOVES_TO_GO = 30; // moves the remaining time is spread over when "movestogo" is not given
+
 // Time manager that ensures that engine will not get stuck in an exploding search
 struct TimeManager {
     int soft_limit_ms = 0; // used at iterative deepening to see if we want to try the next depth
     int hard_limit_ms = 0; // hard cutoff to kill a search mid-search
     bool use_soft_limit = true;
     bool use_hard_limit = true;
+    bool adaptive = false; // soft limit may be rescaled during the search; only with a game clock, since "movetime" asks for a fixed time
+    std::atomic<int> scaled_soft_ms{0}; // soft limit in effect: soft_limit_ms rescaled by update_soft_limit(), never past the hard limit
     std::chrono::steady_clock::time_point start;
+    std::atomic<bool> stop{false}; // raised to abort the search; shared by all search threads
+    std::atomic<bool> ponder{false}; // set by "go ponder"; no limit expires until "ponderhit" clears it
+    std::atomic<int> clock_offset_ms{0}; // time spent pondering before "ponderhit", which does not count against our clock
 
     void start_clock(){
         start = std::chrono::steady_clock::now();
+        clock_offset_ms = 0;
     }
 
+    // Wall-clock time since the search started, pondering included; this is what info lines report as "time"
     int elapsed_ms(){
         using namespace std::chrono;
         return (int)duration_cast<milliseconds>(steady_clock::now() - start).count();
     }
 
+    // Time used on our own clock, which the limits are checked against; excludes any time spent pondering
+    int clock_ms(){
+        return elapsed_ms() - clock_offset_ms;
+    }
+
+    // Converts a ponder search into a normal timed search without restarting it
+    // The limits set up by "go ponder" then run from this moment, since the opponent has just played the expected move
+    void ponderhit(){
+        clock_offset_ms = elapsed_ms();
+        ponder = false;
+    }
+
     // Initializes limits for "go" if wtime and btime are supplied
-    void init_clock(int time_left_ms, int increment_ms, int moves_to_go = 40) {
-        int safe = std::max(1, time_left_ms);
+    // The soft limit is an even share of the time left plus most of the increment; no single move may take more than a third
+    // of the time left, or nearly all of it when this is the last move before the time control
+    void init_clock(int time_left_ms, int increment_ms, int moves_to_go = 0) {
+        int safe = std::max(1, time_left_ms - MOVE_OVERHEAD_MS);
 
-        int mtg = moves_to_go > 0 ? moves_to_go : 40;
-        int base = safe / mtg;
-        int bonus = increment_ms /2;
+        int mtg = moves_to_go > 0 ? std::min(moves_to_go, DEFAULT_MOVES_TO_GO) : DEFAULT_MOVES_TO_GO;
+        int max_ms = std::max(1, mtg == 1 ? safe * 9 / 10 : safe / 3);
 
-        soft_limit_ms = base + bonus;
-        soft_limit_ms = std::max(1, soft_limit_ms);
+        soft_limit_ms = std::clamp(safe / mtg + increment_ms * 3 / 4, 1, max_ms);
+        hard_limit_ms = std::min(soft_limit_ms * 4, max_ms);
 
-        hard_limit_ms = std::min(soft_limit_ms * 3, safe / 4);
-        hard_limit_ms = std::max(soft_limit_ms, hard_limit_ms);
-        
         use_soft_limit = true;
         use_hard_limit = true;
+        adaptive = true;
+        scaled_soft_ms = soft_limit_ms;
+    }
+
+    // Rescales the soft limit after a completed iteration of a clock search, from three signs of how settled the search is:
+    // - stable_iterations: a best move that keeps changing needs more time, one that has held for several iterations less
+    // - score_drop_cp: a falling score (previous iteration minus this one) means trouble was found, worth time to resolve
+    // - best_move_fraction: the share of root nodes spent on the best move; when nearly all of them went to it, the
+    //   alternatives were refuted quickly and the choice is clear
+    // https://www.chessprogramming.org/Time_Management
+    void update_soft_limit(int stable_iterations, int score_drop_cp, double best_move_fraction) {
+        if (!adaptive) return;
+        double stability = 1.6 - 0.15 * std::min(stable_iterations, 6);          // 1.6 right after a change, 0.7 once settled
+        double drop = 1.0 + 0.6 * std::clamp(score_drop_cp, 0, 100) / 100.0;    // up to 1.6 for a drop of a pawn or more
+        double effort = std::clamp(1.6 - best_move_fraction, 0.6, 1.3);         // 0.6 when one move took every node
+        double scale = std::clamp(stability * drop * effort, 0.3, 2.5);
+        scaled_soft_ms = std::clamp(int(soft_limit_ms * scale), 1, hard_limit_ms);
     }
 
     // Initializes limits for "go movetime"
@@ -47,6 +86,8 @@ struct TimeManager {
 
         use_soft_limit = true;
         use_hard_limit = true;
+        adaptive = false;
+        scaled_soft_ms = soft_limit_ms;
     }
 
     // Iniializes limits for "go depth" without wtime or btime
@@ -56,9 +97,20 @@ struct TimeManager {
 
         use_soft_limit = false;
         use_hard_limit = true;
+        adaptive = false;
+        scaled_soft_ms = soft_limit_ms;
+    }
+
+    // Initializes limits for "go infinite"; only "stop" ends the search
+    void init_infinite() {
+        soft_limit_ms = hard_limit_ms = 0;
+        use_soft_limit = false;
+        use_hard_limit = false;
+        adaptive = false;
+        scaled_soft_ms = soft_limit_ms;
     }
 
     // Check if limits are reached
-    bool soft_expired() { return use_soft_limit && elapsed_ms() >= soft_limit_ms; }
-    bool hard_expired() { return use_hard_limit && elapsed_ms() >= hard_limit_ms; }
+    bool soft_expired() { return !ponder && use_soft_limit && clock_ms() >= scaled_soft_ms; }
+    bool hard_expired() { return !ponder && use_hard_limit && clock_ms() >= hard_limit_ms; }
 };
\ No newline at end of file
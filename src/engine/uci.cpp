@@ -7,6 +7,10 @@
 #include <cassert>
 #include <chrono>
 #include <cmath>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <thread>
 
 #include "board.h"
 #include "move_gen.h"
@@ -14,6 +18,7 @@
 #include "search.h"
 #include "zobrist.h"
 #include "time_man.h"
+#include "bench.h"
 
 static const char* ENGINE_NAME = "chess-115a";
 static const char* ENGINE_AUTHOR = "Team";
@@ -76,10 +81,98 @@ static SearchLimits parse_go(const std::vector<std::string>& tok) {
             }
             continue;
         }
+        if (tok[i] == "movestogo") {
+            if (i + 1 < tok.size()) {
+                lim.movestogo = std::stoi(tok[i + 1]);
+            }
+            continue;
+        }
+        if (tok[i] == "infinite") {
+            lim.infinite = true;
+            continue;
+        }
+        if (tok[i] == "ponder") {
+            lim.ponder = true;
+            continue;
+        }
     }
     return lim;
 }
 
+// Writes one line to stdout and flushes it; safe to call from the search thread while the UCI loop is reading input
+// The flush matters: while a search runs the loop is blocked in getline, so nothing else would push the output to a piped GUI
+void uci_send(const std::string& line) {
+    static std::mutex out_mutex;
+    std::lock_guard<std::mutex> lock(out_mutex);
+    std::cout << line << std::endl;
+}
+
+// Expected reply to the best move, sent as "bestmove ... ponder <move>" so the GUI knows which move to ponder on
+// Taken from the PV, or from the TT entry of the position after the best move when the PV was cut short; 0 if there is none
+static Move ponder_move(Board& board, TranspositionTable& tt, const SearchResult& r) {
+    Move best_move = r.best_move;
+    if (best_move == 0) return 0;
+    if (r.pv.length > 1 && r.pv.moves[0] == best_move) return r.pv.moves[1];
+    StateStack ss;
+    StGuard guard(board, init_state_stack(board, ss));
+    do_move(board, ss, best_move);
+    int alpha = -32000, beta = 32000, score = 0;
+    Move reply = 0;
+    tt.probe(board.st->zobrist, MAX_PLY, 0, alpha, beta, score, reply); // depth MAX_PLY: only the move is wanted
+    if (reply != 0 && !is_legal_move(board, reply)) reply = 0;
+    undo_move(board, ss, best_move);
+    return reply;
+}
+
+// Runs a "go" search and reports the result; runs on the search thread so that the UCI loop stays responsive
+// board is the search's own copy, with the root state in board.root
+// In "go infinite" and "go ponder" the bestmove is held back until "stop" or "ponderhit", even if the search finishes first, as UCI requires
+static void search_and_report(Board board, TranspositionTable& tt, TimeManager& tm, int depth, int threads, int multipv, bool infinite, bool send_ponder) {
+    board.st = &board.root;
+    SearchStats stats{};
+    SearchResult r = iter_deepening(board, tt, stats, tm, depth, threads, true, multipv); // info lines are sent as the search runs
+
+    while ((infinite || tm.ponder) && !tm.stop)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    if (r.best_move == 0) {
+        uci_send("bestmove 0000");
+        return;
+    }
+    Move reply = send_ponder ? ponder_move(board, tt, r) : 0;
+    uci_send("bestmove " + move_to_uci(r.best_move) + (reply ? " ponder " + move_to_uci(reply) : ""));
+}
+
+// Parses a "setoption name <id> [value <x>]" command and updates the engine options
+static void set_option(const std::vector<std::string>& tok, EngineOptions& options, TranspositionTable& tt) {
+    std::string name, value;
+    size_t i = 1;
+    if (i < tok.size() && tok[i] == "name") i++;
+    for (; i < tok.size() && tok[i] != "value"; i++)
+        name += (name.empty() ? "" : " ") + tok[i];
+    if (i < tok.size() && tok[i] == "value") i++;
+    for (; i < tok.size(); i++)
+        value += (value.empty() ? "" : " ") + tok[i];
+
+    try {
+        if (name == "Threads") {
+            options.threads = std::clamp(std::stoi(value), 1, MAX_THREADS);
+        }
+        else if (name == "Hash") {
+            options.hash_mb = std::clamp(std::stoi(value), 1, MAX_HASH_MB);
+            tt.resize_mb(options.hash_mb, options.threads);
+        }
+        else if (name == "MultiPV") {
+            options.multipv = std::clamp(std::stoi(value), 1, MAX_MOVES);
+        }
+        else if (name == "Ponder") {
+            options.ponder = (value == "true");
+        }
+    } catch (const std::exception&) {
+        // ignore malformed values
+    }
+}
+
 // Convert an internal Move to a UCI move
 std::string move_to_uci(Move m) {
     std::string s = int_to_algebraic(get_from_sq(m)) + int_to_algebraic(get_to_sq(m));
@@ -96,8 +189,10 @@ std::string move_to_uci(Move m) {
 }
 
 // Convert a UCI move to an internal Move
-Move uci_to_move(Board& b, StateStack& ss, std::string uci){
-    for(Move m : generate_moves(b, ss)){
+Move uci_to_move(Board& b, std::string uci){
+    MoveList moves;
+    generate_moves(b, moves);
+    for(Move m : moves){
         if(move_to_uci(m) == uci){
             return m;
         }
@@ -105,16 +200,25 @@ Move uci_to_move(Board& b, StateStack& ss, std::string uci){
     return 0;
 }
 
+// Sets up a new game from fen; history then holds only the starting state, which board.st points to
+static void new_game(Board& board, std::deque<BoardState>& history, const std::string& fen){
+    board = get_board(fen);
+    history.clear();
+    history.push_back(board.root);
+    board.st = &history.back();
+}
+
 // Parses a "position" command and sets up the specified position
-static void set_position(const std::vector<std::string>& tok, Board& board, StateStack& ss){
+// The state after every move is kept in history, linked through previous, so the search can detect repetitions of game positions
+// A deque never moves its elements, so the previous pointers stay valid however long the game gets
+static void set_position(const std::vector<std::string>& tok, Board& board, std::deque<BoardState>& history){
     // "position startpos"
     // "position fen <6 fields>"
     if (tok.size() < 2) return;
 
     size_t i = 1;
     if (tok[i] == "startpos") {
-        board = get_board(STARTPOS_FEN);
-        init_state_stack(board, ss);
+        new_game(board, history, STARTPOS_FEN);
         i++;
     } else if (tok[i] == "fen") {
         if (tok.size() < i + 1 + 6) return;
@@ -123,8 +227,7 @@ static void set_position(const std::vector<std::string>& tok, Board& board, Stat
             if (k) fen += " ";
             fen += tok[i + 1 + k];
         }
-        board = get_board(fen);
-        init_state_stack(board, ss);
+        new_game(board, history, fen);
         i += 1 + 6;
     } else {
         return;
@@ -132,10 +235,14 @@ static void set_position(const std::vector<std::string>& tok, Board& board, Stat
 
     if (i < tok.size() && tok[i] == "moves"){
         i++;
+        StateStack ss;
         for(; i < tok.size(); i++){
-            Move m = uci_to_move(board, ss, tok[i]);
+            Move m = uci_to_move(board, tok[i]);
             if(m == 0) break; // break when illegal move played
-            do_move(board, ss, m);
+            ss.ply = 0;
+            do_move(board, ss, m); // the new state links back to history.back()
+            history.push_back(*board.st);
+            board.st = &history.back();
         }
     }
 }
@@ -143,13 +250,21 @@ static void set_position(const std::vector<std::string>& tok, Board& board, Stat
 // Main UCI loop
 int run_uci_loop() {
 
-    StateStack ss;
-    Board board = get_board(STARTPOS_FEN);
-    BoardState* new_st = init_state_stack(board, ss);
-    StGuard guard(board, new_st);
+    Board board;
+    std::deque<BoardState> history; // game states from the last "position" command; board.st points to the last one
+    new_game(board, history, STARTPOS_FEN);
     TranspositionTable tt;
-    TimeManager tm;
-    tt.resize_mb(256);
+    EngineOptions options;
+    tt.resize_mb(options.hash_mb);
+    TimeManager time_man;
+    std::thread search_thread;
+
+    // Stops a running search and waits for its bestmove; called before anything that touches the board, TT or options
+    auto stop_search = [&]() {
+        if (!search_thread.joinable()) return;
+        time_man.stop = true;
+        search_thread.join();
+    };
 
     std::string line;
     while (std::getline(std::cin, line)) {
@@ -160,22 +275,46 @@ int run_uci_loop() {
         
         // UCI confirmation
         if (cmd == "uci") {
-            std::cout << "id name " << ENGINE_NAME << "\n";
-            std::cout << "id author " << ENGINE_AUTHOR << "\n";
-            std::cout << "uciok\n";
+            uci_send(std::string("id name ") + ENGINE_NAME);
+            uci_send(std::string("id author ") + ENGINE_AUTHOR);
+            uci_send("option name Hash type spin default " + std::to_string(EngineOptions{}.hash_mb) + " min 1 max " + std::to_string(MAX_HASH_MB));
+            uci_send("option name Threads type spin default 1 min 1 max " + std::to_string(MAX_THREADS));
+            uci_send("option name MultiPV type spin default 1 min 1 max " + std::to_string(MAX_MOVES));
+            uci_send("option name Ponder type check default false");
+            uci_send("uciok");
         }
-        // Ready to move
+        // Ready to move; answered immediately, even while searching
         else if (cmd == "isready") {
-            std::cout << "readyok\n";
+            uci_send("readyok");
+        }
+        // Stop the current search; the search thread then sends its bestmove
+        else if (cmd == "stop") {
+            stop_search();
         }
-        // Indicates a new game
+        // The opponent played the move we were pondering on; the ponder search continues as a normal timed search
+        else if (cmd == "ponderhit") {
+            time_man.ponderhit();
+        }
+        // Indicates a new game; results from the previous game are dropped from the TT
         else if (cmd == "ucinewgame") {
-            board = get_board(STARTPOS_FEN);
-            init_state_stack(board, ss);
+            stop_search();
+            new_game(board, history, STARTPOS_FEN);
+            tt.clear(options.threads);
+        }
+        // Set an engine option
+        // Supported options
+        //     "Hash" = transposition table size in MB
+        //     "Threads" = number of search threads (Lazy SMP)
+        //     "MultiPV" = number of best lines to search and report
+        //     "Ponder" = GUI may ask us to ponder; adds the expected reply to bestmove
+        else if (cmd == "setoption") {
+            stop_search();
+            set_option(tok, options, tt);
         }
         // Set a position
         else if (cmd == "position") {
-            set_position(tok, board, ss);
+            stop_search();
+            set_position(tok, board, history);
         }
         // Evaluate and search for a best move in the position
         // Supported options
@@ -185,62 +324,76 @@ int run_uci_loop() {
         //     "btime" = black has N ms left
         //     "winc" = white gains N ms per move
         //     "binc" = black ganis N ms per move
-        // Unsupported
+        //     "movestogo" = N moves until the next time control
         //     "infinite" = search until "stop" is given
+        //     "ponder" = search the expected reply on the opponent's time, without limits until "ponderhit"
+        // The search runs on its own thread; the loop keeps reading commands such as "stop" and "isready"
         else if (cmd == "go") {
+            stop_search();
             SearchLimits limits = parse_go(tok);
-            TimeManager time_man;
-            if(limits.movetime >= 0){
+            time_man.stop = false;
+            time_man.ponder = limits.ponder;
+            if(limits.infinite){
+                time_man.init_infinite();
+            }
+            else if(limits.movetime >= 0){
                 time_man.init_movetime(limits.movetime);
             }
             else if(limits.wtime >= 0 && limits.btime >= 0) {
                 time_man.init_clock(board.to_move == WHITE ? limits.wtime : limits.btime, 
-                                    board.to_move == WHITE ? limits.winc : limits.binc);
+                                    board.to_move == WHITE ? limits.winc : limits.binc, limits.movestogo);
             }
             else{
                 time_man.init_depth();
             }
 
-            SearchStats stats{};
-            auto start = std::chrono::steady_clock::now();
+            // the search gets its own copy of the position; its root still links back into history, which no command
+            // changes before stop_search() has joined the search thread
+            Board search_board = board;
+            search_board.root = *board.st;
             time_man.start_clock();
-            SearchResult r = iter_deepening(board, tt, stats, time_man, limits.depth);
-            auto end = std::chrono::steady_clock::now();
-            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-            uint64_t nps = (ms > 0) ? (stats.nodes * 1000ULL) / ms : 0;
-
-            std::cout 
-                << "info depth " << stats.depth  
-                << " seldepth " << stats.seldepth 
-                << " nodes " << stats.nodes
-                << " time " << ms
-                << " nps " << nps
-                << " score cp " << r.score_cp << "\n";
-
-            if (r.best_move == 0) {
-                std::cout << "bestmove 0000\n";
-            } else {
-                std::cout << "bestmove " << move_to_uci(r.best_move) << "\n";
-            }
+            search_thread = std::thread(search_and_report, search_board, std::ref(tt), std::ref(time_man),
+                                        limits.depth, options.threads, options.multipv, limits.infinite, options.ponder);
         }
         // Print full board info
         else if (cmd == "d"){
+            stop_search();
             print_board(board);
         }
+        // Search the bench suite; bench [depth] [threads] [hash]
+        else if (cmd == "bench"){
+            stop_search();
+            bench_command(std::vector<std::string>(tok.begin() + 1, tok.end()));
+        }
         // Run perft to depth N, defaults to 5
         // perft depth N to set depth
+        // perft ... verify to cross-check move generation against the reference implementations
+        // perft ... threads N to split the root moves across N threads
+        // perft ... hash MB to count transpositions once using a perft hash of MB megabytes
         else if (cmd == "perft"){
+            stop_search();
             SearchLimits limits = parse_go(tok);
             int default_depth = 5;
-            perft_divide(board, limits.depth == MAX_PLY - 1 ? default_depth : limits.depth);
+            bool verify = std::find(tok.begin(), tok.end(), "verify") != tok.end();
+            int threads = 1;
+            int hash_mb = 0;
+            for (size_t i = 1; i + 1 < tok.size(); i++) {
+                try {
+                    if (tok[i] == "threads") threads = std::clamp(std::stoi(tok[i + 1]), 1, MAX_THREADS);
+                    if (tok[i] == "hash") hash_mb = std::clamp(std::stoi(tok[i + 1]), 0, MAX_HASH_MB);
+                } catch (const std::exception&) {
+                    // ignore malformed values
+                }
+            }
+            perft_divide(board, limits.depth == MAX_PLY - 1 ? default_depth : limits.depth, verify, threads, hash_mb);
         }
         // Quit
         else if (cmd == "quit") {
             break;
         }
-        // ignore: setoption, stop
     }
 
+    stop_search();
     return 0;
 }
 
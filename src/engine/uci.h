@@ -20,15 +20,31 @@ struct SearchLimits{
     int btime = -1;
     int winc = 0;
     int binc = 0;
+    int movestogo = 0; // moves until the next time control; 0 if not given
     bool infinite = false;
+    bool ponder = false;
+};
+
+static constexpr int MAX_THREADS = 256;
+static constexpr int MAX_HASH_MB = 1 << 20;
+
+// Engine options configurable with "setoption"
+struct EngineOptions{
+    int threads = 1;
+    int hash_mb = 256; // transposition table size
+    int multipv = 1; // number of best lines reported by "go"
+    bool ponder = false; // GUI allows pondering; only used to advertise a ponder move with bestmove
 };
 
 // Main UCI loop
 int run_uci_loop();
 
+// Writes one line to stdout and flushes it; safe to call from the search thread while the UCI loop is reading input
+void uci_send(const std::string& line);
+
 // Convert an internal Move to UCI format
 std::string move_to_uci(Move m);
 
 // Convert a UCI move to an internal Move
-Move uci_to_move(Board& b, StateStack& ss, std::string uci);
+Move uci_to_move(Board& b, std::string uci);
 